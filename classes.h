@@ -7,706 +7,5729 @@
 #include <cmath>
 #include <cstdio>
 #include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <unordered_map>
+#include <stdexcept>
+#include <memory>
+#include <optional>
+#include <span>
+#include <algorithm>
+#include <tuple>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <shared_mutex>
+#include <atomic>
+#include <exception>
+#include <chrono>
+#include <charconv>
+#include <climits>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 using namespace std;
 
+// Logging. Every message has a level: levels above LHI_LOG_LEVEL are compiled out (the message isn't
+// even formatted), the rest are filtered at run time by setLogLevel(). Release builds (-DNDEBUG) keep
+// LOG_INFO and up, so the per-record tracing of inserts and splits costs nothing there.
+enum LogLevel {
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,      // what the index did: builds, opens, recovery, compaction (the default verbosity)
+    LOG_DEBUG,     // splits and merges
+    LOG_TRACE      // every record and block touched by an insert or split
+};
+
+#ifndef LHI_LOG_LEVEL
+#ifdef NDEBUG
+#define LHI_LOG_LEVEL LOG_INFO
+#else
+#define LHI_LOG_LEVEL LOG_TRACE
+#endif
+#endif
+
+inline atomic<int> &logVerbosity() {
+    static atomic<int> verbosity(LOG_INFO);
+    return verbosity;
+}
+
+// Messages more detailed than level are dropped (nothing past LHI_LOG_LEVEL can be turned back on)
+inline void setLogLevel(LogLevel level) {
+    logVerbosity().store(level, memory_order_relaxed);
+}
+
+inline bool logEnabled(LogLevel level) {
+    return level <= logVerbosity().load(memory_order_relaxed);
+}
+
+// Where log lines go, cout unless changed with setLogStream()
+inline ostream *&logStream() {
+    static ostream *stream = &cout;
+    return stream;
+}
+
+inline void setLogStream(ostream &stream) {
+    logStream() = &stream;
+}
+
+// Keeps lines from threads of the parallel build from interleaving
+inline mutex &logMutex() {
+    static mutex lock;
+    return lock;
+}
+
+// Usage: LHI_LOG(LOG_TRACE, "Bucket index: " << bucketIdx);
+// One line per message, ended with '\n' rather than endl so logging doesn't flush on every line
+#define LHI_LOG(level, message)                                     \
+    do {                                                            \
+        if constexpr ((level) <= LHI_LOG_LEVEL) {                   \
+            if (logEnabled(level)) {                                \
+                lock_guard<mutex> logLock(logMutex());              \
+                *logStream() << message << '\n';                    \
+            }                                                       \
+        }                                                           \
+    } while (0)
+
+// LZ4 style compression of short values, one record at a time (see RecordView::compressed()). Output is in
+// LZ4's block format: sequences of a token (4 bit literal length, 4 bit match length), the literals and a 2 byte
+// offset back to where the match is copied from, lengths of 15 and up continued in extra bytes. Matches are
+// found through a small hash table of the 4 byte sequences seen so far, so it only pays off on text that
+// repeats itself within the value (the lorem-style bios do)
+class LzCodec {
+public:
+    static constexpr int MIN_MATCH = 4;
+    static constexpr int MAX_OFFSET = 0xFFFF;
+
+    // Like LZ4 the last LAST_LITERALS bytes are always literals and no match starts in the last MATCH_LIMIT
+    static constexpr int LAST_LITERALS = 5;
+    static constexpr int MATCH_LIMIT = 12;
+
+    // Append the compressed form of src to dest
+    static void compress(string_view src, vector<char> &dest) {
+
+        const char *in = src.data();
+        int length = src.length();
+
+        int table[1 << HASH_BITS];
+        fill(begin(table), end(table), -1);
+
+        int anchor = 0;
+        int pos = 0;
+
+        while (pos + MATCH_LIMIT <= length) {
+
+            uint32_t sequence = read32(in + pos);
+            int &slot = table[hashOf(sequence)];
+            int candidate = slot;
+            slot = pos;
+
+            if (candidate < 0 || pos - candidate > MAX_OFFSET || read32(in + candidate) != sequence) {
+                pos++;
+                continue;
+            }
+
+            int matchLength = MIN_MATCH;
+            while (pos + matchLength < length - LAST_LITERALS && in[candidate + matchLength] == in[pos + matchLength])
+                matchLength++;
+
+            // The match may also reach back into the literals before it
+            while (pos > anchor && candidate > 0 && in[pos - 1] == in[candidate - 1]) {
+                pos--;
+                candidate--;
+                matchLength++;
+            }
+
+            writeSequence(in + anchor, pos - anchor, pos - candidate, matchLength, dest);
+            pos += matchLength;
+            anchor = pos;
+
+        }
+
+        // Last sequence is literals only
+        writeSequence(in + anchor, length - anchor, 0, 0, dest);
+
+    }
+
+    // Decompress src into dest, which has to be exactly as long as the original value
+    static void decompress(string_view src, char *dest, int destLength) {
+
+        const uint8_t *in = reinterpret_cast<const uint8_t *>(src.data());
+        const uint8_t *inEnd = in + src.length();
+        int out = 0;
+
+        while (true) {
+
+            if (in == inEnd)
+                throw runtime_error("LzCodec: compressed value is cut short");
+
+            int token = *in++;
+            int literalLength = readLength(token >> 4, in, inEnd);
+            if (literalLength > inEnd - in || literalLength > destLength - out)
+                throw runtime_error("LzCodec: literals run past the end of the value");
+
+            memcpy(dest + out, in, literalLength);
+            in += literalLength;
+            out += literalLength;
+
+            if (in == inEnd)
+                break;
+
+            if (inEnd - in < 2)
+                throw runtime_error("LzCodec: compressed value is cut short");
+            int offset = in[0] | (in[1] << 8);
+            in += 2;
+
+            int matchLength = readLength(token & 15, in, inEnd) + MIN_MATCH;
+            if (offset == 0 || offset > out || matchLength > destLength - out)
+                throw runtime_error("LzCodec: match runs outside the value");
+
+            // Byte by byte, a match may overlap the bytes it is producing
+            for (int b = 0; b < matchLength; b++, out++)
+                dest[out] = dest[out - offset];
+
+        }
+
+        if (out != destLength)
+            throw runtime_error("LzCodec: value decompressed to the wrong length");
+
+    }
+
+private:
+    static constexpr int HASH_BITS = 12;
+
+    static uint32_t read32(const char *p) {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    static int hashOf(uint32_t sequence) {
+        return (sequence * 2654435761U) >> (32 - HASH_BITS);
+    }
+
+    // Length of 15 or more in a token nibble goes on in bytes of 255 and a last byte under 255
+    static void writeLength(int length, vector<char> &dest) {
+        for (length -= 15; length >= 255; length -= 255)
+            dest.push_back((char)255);
+        dest.push_back((char)length);
+    }
+
+    static int readLength(int nibble, const uint8_t *&in, const uint8_t *inEnd) {
+
+        int length = nibble;
+        if (nibble != 15)
+            return length;
+
+        int extra;
+        do {
+            if (in == inEnd)
+                throw runtime_error("LzCodec: compressed value is cut short");
+            extra = *in++;
+            length += extra;
+        } while (extra == 255);
+
+        return length;
+
+    }
+
+    // Literals, then a match of matchLength bytes offset back (none if matchLength is 0)
+    static void writeSequence(const char *literals, int literalLength, int offset, int matchLength, vector<char> &dest) {
+
+        int matchNibble = matchLength == 0 ? 0 : min(matchLength - MIN_MATCH, 15);
+        dest.push_back((char)((min(literalLength, 15) << 4) | matchNibble));
+        if (literalLength >= 15)
+            writeLength(literalLength, dest);
+
+        dest.insert(dest.end(), literals, literals + literalLength);
+
+        if (matchLength == 0)
+            return;
+
+        dest.push_back((char)(offset & 0xFF));
+        dest.push_back((char)(offset >> 8));
+        if (matchLength - MIN_MATCH >= 15)
+            writeLength(matchLength - MIN_MATCH, dest);
+
+    }
+};
+
 class Record {
 public:
     int id, manager_id;
     std::string bio, name;
 
-    Record(vector<std::string> fields) {
-        id = stoi(fields[0]);
-        name = fields[1];
-        bio = fields[2];
-        manager_id = stoi(fields[3]);
+    Record(int recordId, std::string recordName, std::string recordBio, int recordManagerId)
+        : id(recordId), manager_id(recordManagerId), bio(std::move(recordBio)), name(std::move(recordName)) {}
+
+    void print() {
+        cout << "\tID: " << id << "\n";
+        cout << "\tNAME: " << name << "\n";
+        cout << "\tBIO: " << bio << "\n";
+        cout << "\tMANAGER_ID: " << manager_id << "\n";
+    }
+
+    // Number of bytes writeRecord() produces
+    int encodedSize() const {
+
+        // id and manager_id are both fixed 8 bytes, name is prefixed with its 4 byte length
+        // bio and name size depend on length (variable size), bio runs to the end of the record
+        return 8 + 8 + 4 + name.length() + bio.length();
+
+    }
+
+    // Calculate size of record to determine if it can fit in block
+    // (encoded record plus the 8 byte slot entry pointing at it)
+    int calcSize() const {
+        return encodedSize() + 8;
+    }
+
+    // Takes pointer into a page buffer and writes all member variables (not member functions) to it
+    // (see RecordView::encode() for the layout)
+    // Returns the number of bytes written (same as encodedSize())
+    int writeRecord(char *dest) const;
+
+};
+
+// Non-owning view of a record that is still sitting in a page buffer (format written by
+// Record::writeRecord()). Nothing is copied or allocated, name and bio point straight into
+// the page, so a view is only valid while the page it came from stays pinned.
+// A bio may be stored LZ compressed (see compressed()), then bio holds the compressed bytes and
+// it is only decompressed when it is asked for with bioText() or toRecord()
+class RecordView {
+public:
+    int64_t id, manager_id;
+    string_view name, bio;
+    bool bioCompressed = false;
+    int bioTextLength = 0;      // Length of the decompressed bio (only set if bioCompressed)
+
+    // Offsets of the fixed width fields within an encoded record
+    static constexpr int ID_OFFSET = 0;
+    static constexpr int MANAGER_ID_OFFSET = 8;
+    static constexpr int NAME_LENGTH_OFFSET = 16;
+    static constexpr int NAME_OFFSET = 20;
+
+    // Set in the name length field of a record whose bio is compressed
+    static constexpr uint32_t COMPRESSED_BIO_FLAG = 0x80000000;
+
+    // Bios shorter than this are never worth compressing
+    static constexpr int MIN_COMPRESSED_BIO = 64;
+
+    // View of the fields of an owning Record (only valid while the record is)
+    static RecordView of(const Record &record) {
+        RecordView view;
+        view.id = record.id;
+        view.manager_id = record.manager_id;
+        view.name = record.name;
+        view.bio = record.bio;
+        return view;
+    }
+
+    // Read just the 8 byte id of an encoded record (what a probe compares against)
+    static int64_t decodeId(const char *data) {
+        int64_t paddedId;
+        memcpy(&paddedId, data + ID_OFFSET, sizeof(paddedId));
+        return paddedId;
+    }
+
+    // Decode all fields of an encoded record of the given length
+    static RecordView decode(const char *data, int length) {
+
+        RecordView view;
+        uint32_t nameLengthField;
+
+        view.id = decodeId(data);
+        memcpy(&view.manager_id, data + MANAGER_ID_OFFSET, sizeof(view.manager_id));
+        memcpy(&nameLengthField, data + NAME_LENGTH_OFFSET, sizeof(nameLengthField));
+
+        // Name follows its length, bio takes up the rest of the record
+        // (a compressed bio starts with the length of its text)
+        int nameLength = nameLengthField & ~COMPRESSED_BIO_FLAG;
+        int bioOffset = NAME_OFFSET + nameLength;
+        view.name = string_view(data + NAME_OFFSET, nameLength);
+
+        if (nameLengthField & COMPRESSED_BIO_FLAG) {
+            view.bioCompressed = true;
+            memcpy(&view.bioTextLength, data + bioOffset, sizeof(view.bioTextLength));
+            bioOffset += sizeof(view.bioTextLength);
+        }
+        view.bio = string_view(data + bioOffset, length - bioOffset);
+
+        return view;
+
+    }
+
+    // The bio itself, decompressed if it is stored compressed
+    string bioText() const {
+
+        if (!bioCompressed)
+            return string(bio);
+
+        string text(bioTextLength, '\0');
+        LzCodec::decompress(bio, text.data(), bioTextLength);
+        return text;
+
+    }
+
+    // Copy the viewed fields out into an owning Record
+    Record toRecord() const {
+        return Record((int)id, string(name), bioText(), (int)manager_id);
+    }
+
+    // Copy of the view with its bio compressed into buffer (which the copy points into), or the view
+    // itself if the bio is already compressed or doesn't get any shorter
+    RecordView compressed(vector<char> &buffer) const {
+
+        if (bioCompressed || (int)bio.length() < MIN_COMPRESSED_BIO)
+            return *this;
+
+        buffer.clear();
+        LzCodec::compress(bio, buffer);
+        if (buffer.size() + sizeof(int) >= bio.length())
+            return *this;
+
+        RecordView view = *this;
+        view.bio = string_view(buffer.data(), buffer.size());
+        view.bioCompressed = true;
+        view.bioTextLength = bio.length();
+        return view;
+
+    }
+
+    // Number of bytes writeRecord() produces
+    int encodedSize() const {
+        return NAME_OFFSET + name.length() + (bioCompressed ? sizeof(int) : 0) + bio.length();
+    }
+
+    // Encode the viewed fields, so a record parsed straight out of a csv buffer can be written to a page
+    // without going through an owning Record first
+    int writeRecord(char *dest) const {
+        return encode(id, manager_id, name, bio, dest, bioCompressed ? bioTextLength : -1);
+    }
+
+    // Record layout: id, manager id, name length, name, bio. No delimiters are written since
+    // the slot entry of the record already gives its length (so any character can be in a bio)
+    // (since ints are 4 bytes on hadoop server I chose to write size of int * 2 so that ints are 8 bytes)
+    // A bio that is already compressed (bioTextLength >= 0) is written behind the length of its text,
+    // with COMPRESSED_BIO_FLAG set in the name length
+    // Returns the number of bytes written
+    static int encode(int64_t id, int64_t managerId, string_view name, string_view bio, char *dest, int bioTextLength = -1) {
+
+        uint32_t nameLengthField = name.length() | (bioTextLength >= 0 ? COMPRESSED_BIO_FLAG : 0);
+        char *start = dest;
+
+        memcpy(dest, &id, sizeof(id));
+        dest += sizeof(id);
+        memcpy(dest, &managerId, sizeof(managerId));
+        dest += sizeof(managerId);
+        memcpy(dest, &nameLengthField, sizeof(nameLengthField));
+        dest += sizeof(nameLengthField);
+        memcpy(dest, name.data(), name.length());
+        dest += name.length();
+        if (bioTextLength >= 0) {
+            memcpy(dest, &bioTextLength, sizeof(bioTextLength));
+            dest += sizeof(bioTextLength);
+        }
+        memcpy(dest, bio.data(), bio.length());
+        dest += bio.length();
+
+        return dest - start;
+
+    }
+};
+
+inline int Record::writeRecord(char *dest) const {
+    // Cast int members to int64_t to write 8 bytes to the page
+    return RecordView::encode((int64_t)id, (int64_t)manager_id, name, bio, dest);
+}
+
+// How the index stores, hashes and compares keys of type Key. Every encoded record starts with its
+// key in this format, so the index can find and compare keys in a page without decoding the record.
+// The primary template covers fixed width integer keys: stored as an 8 byte integer and compared as
+// one, so probing a chain is a plain integer compare per slot.
+template <class Key>
+struct KeyCodec {
+    static_assert(is_integral_v<Key>, "KeyCodec needs a specialization for non-integer keys");
+
+    static int encodedSize(const Key &) {
+        return sizeof(int64_t);
+    }
+
+    static void write(const Key &key, char *dest) {
+        int64_t stored = (int64_t)key;
+        memcpy(dest, &stored, sizeof(stored));
+    }
+
+    static Key read(const char *data) {
+        int64_t stored;
+        memcpy(&stored, data, sizeof(stored));
+        return (Key)stored;
+    }
+
+    // Does the record starting at data have this key
+    static bool matches(const char *data, const Key &key) {
+        int64_t stored;
+        memcpy(&stored, data, sizeof(stored));
+        return stored == (int64_t)key;
+    }
+
+    // What gets fed to the hash function, for a key and for a stored key
+    static uint64_t hashInput(const Key &key) {
+        return (uint64_t)(int64_t)key;
+    }
+
+    static uint64_t storedHashInput(const char *data) {
+        int64_t stored;
+        memcpy(&stored, data, sizeof(stored));
+        return (uint64_t)stored;
+    }
+};
+
+// Short string keys: 2 byte length followed by the characters. Strings are folded to 64 bits
+// (FNV-1a) before the hash function mixes them, the same way for a key and a stored key
+template <>
+struct KeyCodec<string> {
+    static constexpr size_t MAX_LENGTH = 0xFFFF;
+
+    static int encodedSize(const string &key) {
+        return sizeof(uint16_t) + key.length();
+    }
+
+    static void write(const string &key, char *dest) {
+        if (key.length() > MAX_LENGTH)
+            throw runtime_error("KeyCodec: string key is too long");
+        uint16_t length = key.length();
+        memcpy(dest, &length, sizeof(length));
+        memcpy(dest + sizeof(length), key.data(), length);
+    }
+
+    static string_view view(const char *data) {
+        uint16_t length;
+        memcpy(&length, data, sizeof(length));
+        return string_view(data + sizeof(length), length);
+    }
+
+    static string read(const char *data) {
+        return string(view(data));
+    }
+
+    static bool matches(const char *data, const string &key) {
+        return view(data) == key;
+    }
+
+    static uint64_t fold(string_view key) {
+        uint64_t folded = 14695981039346656037ULL;
+        for (char c : key) {
+            folded ^= (unsigned char)c;
+            folded *= 1099511628211ULL;
+        }
+        return folded;
+    }
+
+    static uint64_t hashInput(const string &key) {
+        return fold(key);
+    }
+
+    static uint64_t storedHashInput(const char *data) {
+        return fold(view(data));
+    }
+};
+
+// Serializer trait the index is instantiated with for a record type (the Serializer parameter of
+// LinearHashIndex). It tells the index what a record's key is and how records are encoded, viewed in
+// place, decoded and parsed from a csv line. The encoding must start with the key in KeyCodec format.
+// View is what a record is looked at in place as. It may be the record type itself (a small fixed size
+// record is just copied out), then key(), encodedSize() and write() only need the one overload.
+// This one is the Employee schema: Record keyed by its int id.
+// A serializer may also name a SecondaryKey (with secondaryKey() for records and views), which the index
+// can then keep a secondary index on (see IndexOptions::secondaryIndex). Employees have their manager_id.
+struct EmployeeSerializer {
+    using View = RecordView;
+    using SecondaryKey = int;
+
+    static int key(const Record &record) {
+        return record.id;
+    }
+
+    static int secondaryKey(const Record &record) {
+        return record.manager_id;
+    }
+
+    static int secondaryKey(const View &view) {
+        return (int)view.manager_id;
+    }
+
+    static int encodedSize(const Record &record) {
+        return record.encodedSize();
+    }
+
+    static int write(const Record &record, char *dest) {
+        return record.writeRecord(dest);
+    }
+
+    static View view(const char *data, int length) {
+        return RecordView::decode(data, length);
+    }
+
+    static Record read(const char *data, int length) {
+        return RecordView::decode(data, length).toRecord();
+    }
+
+    // A serializer may compress records for IndexOptions::compressRecords: compress() returns a view of
+    // the record as it should be stored, pointing into buffer where needed. Employees compress their bio
+    static View compress(const Record &record, vector<char> &buffer) {
+        return RecordView::of(record).compressed(buffer);
+    }
+
+    static View compress(const View &view, vector<char> &buffer) {
+        return view.compressed(buffer);
+    }
+
+    // What findRecordById() returns when there is no record with the id
+    static Record missingRecord() {
+        return Record(-1, "", "", -1);
+    }
+
+    // Convert the fields of a csv row (see CsvReader) to a view of an Employee record
+    // Nothing is copied, name and bio point into the reader's buffer
+    static View parseCsvRow(span<const string_view> fields) {
+
+        if (fields.size() != 4)
+            throw runtime_error("Employee csv row needs 4 fields (quote a bio that contains commas)");
+
+        View view;
+        view.id = parseInt(fields[0]);
+        view.name = fields[1];
+        view.bio = fields[2];
+        view.manager_id = parseInt(fields[3]);
+
+        return view;
+
+    }
+
+    static int key(const View &view) {
+        return (int)view.id;
+    }
+
+    static int encodedSize(const View &view) {
+        return view.encodedSize();
+    }
+
+    static int write(const View &view, char *dest) {
+        return view.writeRecord(dest);
+    }
+
+    // Whole field has to be an int, no stoi style skipping of whitespace or trailing junk
+    static int parseInt(string_view field) {
+
+        int value;
+        from_chars_result result = from_chars(field.data(), field.data() + field.size(), value);
+
+        if (result.ec != errc() || result.ptr != field.data() + field.size())
+            throw runtime_error("Bad integer in csv: " + string(field));
+
+        return value;
+
+    }
+};
+
+// Scan predicate on the Employee fields (see LinearHashIndex::scan()), fields left unset match every record.
+// It is checked against the record in place in its page, cheapest field first, so records that don't match
+// are never copied out
+struct EmployeeFilter {
+    optional<int> minId;            // id range, both ends included
+    optional<int> maxId;
+    optional<int> managerId;
+    string namePrefix;
+
+    bool operator()(const RecordView &record) const {
+        return (!minId || record.id >= *minId) && (!maxId || record.id <= *maxId) &&
+               (!managerId || record.manager_id == *managerId) && record.name.starts_with(namePrefix);
+    }
+};
+
+// Streaming csv reader for building the index. The file is read in large chunks with plain read()s and
+// rows are cut out of the chunk buffer in place: fields come back as string_views into the buffer, so
+// reading a row doesn't allocate (the views are only valid until the next call to nextRow()).
+// Delimiters are found 16 bytes at a time with SSE2 compares where available (see findEither()).
+// A field may be quoted ("..."), then it can hold commas, newlines and doubled quotes ("") standing for
+// one quote character. Quoted fields are unescaped in place in the buffer.
+// Reading can be limited to the rows that start within [startOffset, endOffset) of the file, which is how
+// the parallel build cuts up the csv. A range starts at the first newline after startOffset, so a quoted
+// field with a newline in it must not straddle a range boundary.
+class CsvReader {
+public:
+    static constexpr size_t DEFAULT_BUFFER_SIZE = (size_t)4 << 20;
+
+    // A missing file reads as an empty one (check isOpen())
+    CsvReader(const string &csvFName, long long startOffset = 0, long long endOffset = LLONG_MAX,
+              size_t bufferSize = DEFAULT_BUFFER_SIZE)
+        : buffer(bufferSize), endOffset(endOffset) {
+
+        fd = ::open(csvFName.c_str(), O_RDONLY);
+        if (fd == -1) {
+            atEof = true;
+            return;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        // Skip the row the range starts in the middle of, it belongs to the previous range
+        // (starting one byte back makes a row starting right at startOffset count as ours)
+        if (startOffset > 0) {
+            bufferOffset = startOffset - 1;
+            lseek(fd, bufferOffset, SEEK_SET);
+            skippingPartialRow = true;
+        }
+
+    }
+
+    CsvReader(const CsvReader &) = delete;
+    CsvReader &operator=(const CsvReader &) = delete;
+
+    ~CsvReader() {
+        if (fd != -1)
+            ::close(fd);
+    }
+
+    bool isOpen() const {
+        return fd != -1;
+    }
+
+    // Cut the next non-empty row into fields (fields is reused, so it stops allocating once it has
+    // room for a row), returns false once the rows are used up
+    bool nextRow(vector<string_view> &fields) {
+
+        while (true) {
+
+            char *rowStart = buffer.data() + pos;
+            char *dataEnd = buffer.data() + fill;
+
+            if (rowStart == dataEnd) {
+                if (atEof)
+                    return false;
+                refill();
+                continue;
+            }
+
+            if (skippingPartialRow) {
+                char *newline = findEither(rowStart, dataEnd, '\n', '\n');
+                pos = newline - buffer.data();
+                if (newline != dataEnd) {
+                    pos++;
+                    skippingPartialRow = false;
+                }
+                continue;
+            }
+
+            if (bufferOffset + (long long)pos >= endOffset)
+                return false;
+
+            // Row has to be all in the buffer before it is touched, unescaping changes the buffer
+            char *rowEnd = findRowEnd(rowStart, dataEnd);
+            if (rowEnd == dataEnd && !atEof) {
+                refill();
+                continue;
+            }
+
+            pos = min(rowEnd + 1, dataEnd) - buffer.data();
+
+            if (rowEnd > rowStart && rowEnd[-1] == '\r')
+                rowEnd--;
+            if (rowEnd == rowStart)
+                continue;
+
+            splitFields(rowStart, rowEnd, fields);
+            return true;
+
+        }
+
+    }
+
+private:
+    int fd = -1;
+    vector<char> buffer;
+    size_t pos = 0;                 // start of the unread part of the buffer
+    size_t fill = 0;                // end of the data in the buffer
+    long long bufferOffset = 0;     // file offset of buffer[0]
+    long long endOffset;
+    bool atEof = false;
+    bool skippingPartialRow = false;
+
+    // First a or b in [p, end), end if there is none
+    static char *findEither(char *p, char *end, char a, char b) {
+
+#ifdef __SSE2__
+        __m128i matchA = _mm_set1_epi8(a);
+        __m128i matchB = _mm_set1_epi8(b);
+
+        for (; end - p >= 16; p += 16) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+            int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, matchA), _mm_cmpeq_epi8(chunk, matchB)));
+            if (mask != 0)
+                return p + __builtin_ctz(mask);
+        }
+#endif
+
+        for (; p < end; p++) {
+            if (*p == a || *p == b)
+                return p;
+        }
+
+        return end;
+
+    }
+
+    // Newline ending the row that starts at p (newlines inside quotes don't count), end if it isn't in [p, end)
+    static char *findRowEnd(char *p, char *end) {
+
+        bool inQuotes = false;
+
+        while ((p = findEither(p, end, '\n', '"')) != end) {
+            if (*p == '"')
+                inQuotes = !inQuotes;
+            else if (!inQuotes)
+                return p;
+            p++;
+        }
+
+        return end;
+
+    }
+
+    // Split the row [p, end) at the commas that aren't inside quotes
+    static void splitFields(char *p, char *end, vector<string_view> &fields) {
+
+        fields.clear();
+
+        while (true) {
+
+            if (p < end && *p == '"') {
+
+                // Drop the surrounding quotes and turn "" into ", shifting the field left in place
+                char *fieldStart = p;
+                char *out = p;
+                p++;
+
+                while (p < end) {
+
+                    char *quote = findEither(p, end, '"', '"');
+                    memmove(out, p, quote - p);
+                    out += quote - p;
+                    p = quote;
+
+                    if (p + 1 < end && p[1] == '"') {
+                        *out++ = '"';
+                        p += 2;
+                    }
+                    else {
+                        p += (p < end);
+                        break;
+                    }
+
+                }
+
+                fields.emplace_back(fieldStart, out - fieldStart);
+
+                // Anything between the closing quote and the next comma is dropped
+                p = findEither(p, end, ',', ',');
+
+            }
+            else {
+
+                char *comma = findEither(p, end, ',', ',');
+                fields.emplace_back(p, comma - p);
+                p = comma;
+
+            }
+
+            if (p == end)
+                return;
+            p++;
+
+        }
+
+    }
+
+    // Move the unread part of the buffer to its front and read more after it
+    // (the buffer only grows if a single row doesn't fit in it)
+    void refill() {
+
+        size_t remaining = fill - pos;
+        memmove(buffer.data(), buffer.data() + pos, remaining);
+        bufferOffset += pos;
+        pos = 0;
+        fill = remaining;
+
+        if (fill == buffer.size())
+            buffer.resize(buffer.size() * 2);
+
+        ssize_t bytesRead;
+        do {
+            bytesRead = ::read(fd, buffer.data() + fill, buffer.size() - fill);
+        } while (bytesRead == -1 && errno == EINTR);
+
+        if (bytesRead == -1)
+            throw runtime_error("CsvReader: could not read csv file");
+
+        if (bytesRead == 0)
+            atEof = true;
+        fill += bytesRead;
+
+    }
+};
+
+// Page size of an index unless IndexOptions::pageSize says otherwise
+constexpr int DEFAULT_PAGE_SIZE = 4096;
+
+// Page I/O a PageFile has done since it was created (or the counters were reset)
+struct IoCounters {
+    atomic<uint64_t> pageReads{0};
+    atomic<uint64_t> pageWrites{0};
+    atomic<uint64_t> bytesRead{0};
+    atomic<uint64_t> bytesWritten{0};
+    atomic<uint64_t> syncs{0};
+
+    void reset() {
+        pageReads = 0;
+        pageWrites = 0;
+        bytesRead = 0;
+        bytesWritten = 0;
+        syncs = 0;
+    }
+};
+
+// Storage backend for the index file. The buffer pool only talks to the file through this
+// interface so the way pages get to and from disk can be picked when the index is constructed.
+class PageFile {
+public:
+    virtual ~PageFile() {}
+
+    // Every readPage()/writePage()/sync() is counted here. Pages reached through pagePointer() aren't,
+    // with a mapped file the OS does that I/O behind the index's back
+    IoCounters ioCounters;
+
+    // Open (and optionally truncate) the file, returns false if it can't be opened
+    virtual bool open(const string &fileName, bool truncate) = 0;
+    virtual bool isOpen() const = 0;
+    virtual void close() = 0;
+
+    // Copy a whole page in from / out to the file
+    virtual void readPage(int pageIdx, char *dest) = 0;
+    virtual void writePage(int pageIdx, const char *src) = 0;
+
+    // Backends that map the file into memory hand out pointers straight into the mapping
+    // (growing the file if pageIdx is past its end). Others return nullptr and the
+    // buffer pool caches copies of the pages in its frames instead.
+    virtual char *pagePointer(int /*pageIdx*/) { return nullptr; }
+
+    // Push buffered writes out to the OS
+    virtual void flush() = 0;
+
+    // flush() and wait until the OS has the file on disk
+    virtual void sync() = 0;
+
+    // Cut the file down to its first numPages pages
+    virtual void truncate(int numPages) = 0;
+
+    // Hint that pages [firstPage, firstPage + numPages) are about to be read, so the OS can start reading
+    // them in ahead of time (scans use it, see LinearHashIndex::scan())
+    virtual void prefetch(int /*firstPage*/, int /*numPages*/) {}
+};
+
+// Default backend, plain binary fstream with seekg/seekp + read/write of whole pages
+// A seek and the read/write after it have to happen together, so page I/O is serialized
+// (the parallel bulk build writes pages from several threads)
+class StreamPageFile : public PageFile {
+private:
+    const int PAGE_SIZE;
+    fstream file;
+    string path;
+    mutex ioMutex;
+
+    // Read only descriptor of the file for prefetch() hints (fstream doesn't expose its own)
+    int adviceFd = -1;
+
+public:
+    StreamPageFile(int pageSize = DEFAULT_PAGE_SIZE) : PAGE_SIZE(pageSize) {}
+
+    ~StreamPageFile() {
+        close();
+    }
+
+    bool open(const string &fileName, bool truncate) override {
+
+        if (file.is_open())
+            file.close();
+
+        ios::openmode mode = ios::in | ios::out | ios::binary;
+        if (truncate)
+            mode |= ios::trunc;
+
+        file.open(fileName, mode);
+        path = fileName;
+        if (!file.is_open())
+            return false;
+
+        if (adviceFd != -1)
+            ::close(adviceFd);
+        adviceFd = ::open(fileName.c_str(), O_RDONLY);
+
+        return true;
+
+    }
+
+    bool isOpen() const override {
+        return file.is_open();
+    }
+
+    void close() override {
+        if (file.is_open())
+            file.close();
+        if (adviceFd != -1) {
+            ::close(adviceFd);
+            adviceFd = -1;
+        }
+    }
+
+    void prefetch(int firstPage, int numPages) override {
+        if (adviceFd != -1)
+            posix_fadvise(adviceFd, (off_t)firstPage * PAGE_SIZE, (off_t)numPages * PAGE_SIZE, POSIX_FADV_WILLNEED);
+    }
+
+    void readPage(int pageIdx, char *dest) override {
+
+        lock_guard<mutex> lock(ioMutex);
+        file.seekg((streamoff)pageIdx * PAGE_SIZE);
+        file.read(dest, PAGE_SIZE);
+
+        // Last page in the file may be shorter than a full page, so zero fill
+        // whatever wasn't read and clear eof/fail bits so the stream stays usable
+        streamsize bytesRead = file.gcount();
+        if (bytesRead < PAGE_SIZE) {
+            memset(dest + bytesRead, 0, PAGE_SIZE - bytesRead);
+            file.clear();
+        }
+
+        ioCounters.pageReads.fetch_add(1, memory_order_relaxed);
+        ioCounters.bytesRead.fetch_add(bytesRead, memory_order_relaxed);
+
+    }
+
+    void writePage(int pageIdx, const char *src) override {
+        lock_guard<mutex> lock(ioMutex);
+        file.seekp((streamoff)pageIdx * PAGE_SIZE);
+        file.write(src, PAGE_SIZE);
+        ioCounters.pageWrites.fetch_add(1, memory_order_relaxed);
+        ioCounters.bytesWritten.fetch_add(PAGE_SIZE, memory_order_relaxed);
+    }
+
+    void flush() override {
+        lock_guard<mutex> lock(ioMutex);
+        file.flush();
+    }
+
+    // fstream has no descriptor to fsync, but fsync through any descriptor of the file writes back all of it
+    void sync() override {
+
+        lock_guard<mutex> lock(ioMutex);
+        file.flush();
+
+        int fd = ::open(path.c_str(), O_RDWR);
+        if (fd < 0 || fsync(fd) != 0)
+            throw runtime_error("StreamPageFile: could not sync index file");
+        ::close(fd);
+        ioCounters.syncs.fetch_add(1, memory_order_relaxed);
+
+    }
+
+    void truncate(int numPages) override {
+
+        lock_guard<mutex> lock(ioMutex);
+        file.flush();
+        if (::truncate(path.c_str(), (off_t)numPages * PAGE_SIZE) != 0)
+            throw runtime_error("StreamPageFile: could not truncate index file");
+
+    }
+};
+
+// Backend that mmaps the index file. A large range of address space is reserved up front and
+// the file is mapped into it at a fixed address, growing in extents of EXTENT_BYTES at a time
+// (ftruncate + map the new extent right after the old ones). Since the mapping never moves,
+// page pointers handed out earlier stay valid while the file grows underneath them.
+// The extent slack past the last page in use is cut off again by flush() and close(), so the file
+// ends up no bigger than its pages.
+class MmapPageFile : public PageFile {
+private:
+    const int PAGE_SIZE;
+    static constexpr size_t EXTENT_BYTES = 1 << 20;
+
+    int fd;
+    char *base;                     // Start of reserved address range
+    size_t reservedBytes;           // Size of reserved address range (max file size)
+    atomic<size_t> mappedBytes;     // How much of the file is currently mapped (all of it)
+    atomic<size_t> usedBytes;       // End of the last page handed out, the rest of the mapping is slack
+    mutex growMutex;                // Serializes growing the file between threads
+
+    // Grow file and mapping so that everything below neededBytes is mapped and in use
+    void growTo(size_t neededBytes) {
+
+        lock_guard<mutex> lock(growMutex);
+
+        // Another thread may have grown it while we waited
+        if (neededBytes <= usedBytes)
+            return;
+
+        if (neededBytes > mappedBytes)
+            mapMoreLocked(neededBytes);
+
+        // Only once the pages are mapped, pagePointer() hands them out without taking the lock
+        usedBytes.store(neededBytes, memory_order_release);
+
+    }
+
+    // Grow file and mapping to hold at least neededBytes
+    void mapMoreLocked(size_t neededBytes) {
+
+        // Round up to whole extents, and at least double small files so growth stays amortized
+        size_t newBytes = max(neededBytes, min(mappedBytes * 2, mappedBytes + 64 * EXTENT_BYTES));
+        newBytes = (newBytes + EXTENT_BYTES - 1) / EXTENT_BYTES * EXTENT_BYTES;
+
+        if (newBytes > reservedBytes)
+            throw runtime_error("MmapPageFile: index file outgrew reserved address space");
+
+        if (ftruncate(fd, newBytes) != 0)
+            throw runtime_error("MmapPageFile: could not grow index file");
+
+        mapRange(mappedBytes, newBytes);
+
+    }
+
+    // Map [fromBytes, toBytes) of the file at the same offset in the reserved range
+    void mapRange(size_t fromBytes, size_t toBytes) {
+
+        if (toBytes <= fromBytes)
+            return;
+
+        void *mapped = mmap(base + fromBytes, toBytes - fromBytes, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_FIXED, fd, fromBytes);
+        if (mapped == MAP_FAILED)
+            throw runtime_error("MmapPageFile: mmap of index file failed");
+
+        mappedBytes.store(toBytes, memory_order_release);
+
+    }
+
+    // Cut file and mapping down to the first bytes of the file. Mappings (and so the file) end on a whole
+    // OS page, which only leaves a few KB past bytes with index pages smaller than that
+    void shrinkToLocked(size_t bytes) {
+
+        static const size_t OS_PAGE_SIZE = sysconf(_SC_PAGESIZE);
+        size_t newBytes = (bytes + OS_PAGE_SIZE - 1) / OS_PAGE_SIZE * OS_PAGE_SIZE;
+
+        if (newBytes < mappedBytes) {
+            void *reserved = mmap(base + newBytes, mappedBytes - newBytes, PROT_NONE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+            if (reserved == MAP_FAILED)
+                throw runtime_error("MmapPageFile: could not unmap truncated pages");
+            mappedBytes.store(newBytes, memory_order_release);
+        }
+
+        if (ftruncate(fd, newBytes) != 0)
+            throw runtime_error("MmapPageFile: could not truncate index file");
+
+        usedBytes.store(min((size_t)usedBytes, bytes), memory_order_release);
+
+    }
+
+public:
+    // reserve is the largest the index file may grow to (only address space, no memory is used)
+    MmapPageFile(int pageSize = DEFAULT_PAGE_SIZE, size_t reserve = (size_t)1 << 38) : PAGE_SIZE(pageSize) {
+        fd = -1;
+        base = nullptr;
+        reservedBytes = reserve;
+        mappedBytes = 0;
+        usedBytes = 0;
+    }
+
+    ~MmapPageFile() {
+        close();
+    }
+
+    bool open(const string &fileName, bool truncate) override {
+
+        close();
+
+        int flags = O_RDWR;
+        if (truncate)
+            flags |= O_CREAT | O_TRUNC;
+
+        fd = ::open(fileName.c_str(), flags, 0644);
+        if (fd < 0)
+            return false;
+
+        void *reserved = mmap(nullptr, reservedBytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (reserved == MAP_FAILED) {
+            ::close(fd);
+            fd = -1;
+            return false;
+        }
+        base = (char *)reserved;
+
+        // Map whatever the file already holds (rounded up to a whole extent)
+        struct stat fileStat;
+        fstat(fd, &fileStat);
+        if (fileStat.st_size > 0)
+            growTo(fileStat.st_size);
+
+        return true;
+
+    }
+
+    bool isOpen() const override {
+        return fd >= 0;
+    }
+
+    void close() override {
+
+        if (fd >= 0 && mappedBytes > usedBytes) {
+            lock_guard<mutex> lock(growMutex);
+            shrinkToLocked(usedBytes);
+        }
+
+        if (base != nullptr) {
+            munmap(base, reservedBytes);
+            base = nullptr;
+        }
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+        mappedBytes = 0;
+        usedBytes = 0;
+
+    }
+
+    char *pagePointer(int pageIdx) override {
+        size_t pageStart = (size_t)pageIdx * PAGE_SIZE;
+        if (pageStart + PAGE_SIZE > usedBytes.load(memory_order_acquire))
+            growTo(pageStart + PAGE_SIZE);
+        return base + pageStart;
+    }
+
+    void readPage(int pageIdx, char *dest) override {
+        memcpy(dest, pagePointer(pageIdx), PAGE_SIZE);
+        ioCounters.pageReads.fetch_add(1, memory_order_relaxed);
+        ioCounters.bytesRead.fetch_add(PAGE_SIZE, memory_order_relaxed);
+    }
+
+    void writePage(int pageIdx, const char *src) override {
+        memcpy(pagePointer(pageIdx), src, PAGE_SIZE);
+        ioCounters.pageWrites.fetch_add(1, memory_order_relaxed);
+        ioCounters.bytesWritten.fetch_add(PAGE_SIZE, memory_order_relaxed);
+    }
+
+    // Writes land in the shared mapping directly so the OS already has them, only the extent slack is cut off
+    void flush() override {
+        lock_guard<mutex> lock(growMutex);
+        if (mappedBytes > usedBytes)
+            shrinkToLocked(usedBytes);
+    }
+
+    void sync() override {
+        if (msync(base, mappedBytes, MS_SYNC) != 0 || fsync(fd) != 0)
+            throw runtime_error("MmapPageFile: could not sync index file");
+        ioCounters.syncs.fetch_add(1, memory_order_relaxed);
+    }
+
+    // Unmap everything past the new end (handing the range back to the reservation) and shrink the file
+    void truncate(int numPages) override {
+        lock_guard<mutex> lock(growMutex);
+        shrinkToLocked((size_t)numPages * PAGE_SIZE);
+    }
+
+    // Only pages already mapped are hinted, anything past the mapping doesn't exist yet
+    void prefetch(int firstPage, int numPages) override {
+
+        size_t start = (size_t)firstPage * PAGE_SIZE;
+        size_t end = min((size_t)(firstPage + numPages) * PAGE_SIZE, usedBytes.load(memory_order_acquire));
+
+        if (start < end)
+            madvise(base + start, end - start, MADV_WILLNEED);
+
+    }
+};
+
+// Append only file of variable length records, where an index keeps its records when only their keys go in the
+// bucket pages (see IndexOptions::separatePayloads). A record is addressed by its byte offset and never changes
+// once appended. Appends are collected in a tail buffer and written out in large pieces, reads of records still
+// in the tail are served from it. Appends and reads are safe from any number of threads.
+class HeapFile {
+private:
+    static constexpr size_t TAIL_BYTES = (size_t)1 << 20;
+
+    int fd = -1;
+
+    // Records from tailStart on are only in tail. Everything before it is in the file, so reads below
+    // tailStart go straight to the file without taking tailMutex
+    mutex tailMutex;
+    vector<char> tail;
+    atomic<uint64_t> tailStart{0};
+
+    // Bytes the file has handed out up to the last sync()
+    uint64_t syncedBytes = 0;
+
+    void writeTailLocked() {
+
+        size_t written = 0;
+        while (written < tail.size()) {
+            ssize_t result = pwrite(fd, tail.data() + written, tail.size() - written, tailStart + written);
+            if (result < 0)
+                throw runtime_error("HeapFile: could not write heap file");
+            written += result;
+        }
+
+        ioCounters.pageWrites.fetch_add(1, memory_order_relaxed);
+        ioCounters.bytesWritten.fetch_add(tail.size(), memory_order_relaxed);
+
+        tailStart.store(tailStart + tail.size(), memory_order_release);
+        tail.clear();
+
+    }
+
+public:
+    // Every read that goes to the file (and every write of the tail) is counted here, as one "page"
+    IoCounters ioCounters;
+
+    ~HeapFile() {
+        close();
+    }
+
+    // Open an existing heap file, or start an empty one if truncate is set. Returns false if it can't be opened
+    bool open(const string &fileName, bool truncate) {
+
+        close();
+
+        int flags = O_RDWR;
+        if (truncate)
+            flags |= O_CREAT | O_TRUNC;
+
+        fd = ::open(fileName.c_str(), flags, 0644);
+        if (fd < 0)
+            return false;
+
+        struct stat fileStat;
+        fstat(fd, &fileStat);
+        tailStart = fileStat.st_size;
+        syncedBytes = fileStat.st_size;
+
+        return true;
+
+    }
+
+    bool isOpen() const {
+        return fd >= 0;
+    }
+
+    // Whatever is left in the tail is written out first
+    void close() {
+
+        if (fd < 0)
+            return;
+
+        flush();
+        ::close(fd);
+        fd = -1;
+
+    }
+
+    // Bytes in the heap (written out or not)
+    uint64_t size() {
+        lock_guard<mutex> lock(tailMutex);
+        return tailStart + tail.size();
+    }
+
+    // Append length bytes, returns the offset they can be read back from
+    uint64_t append(const char *data, size_t length) {
+
+        lock_guard<mutex> lock(tailMutex);
+
+        uint64_t offset = tailStart + tail.size();
+        tail.insert(tail.end(), data, data + length);
+        if (tail.size() >= TAIL_BYTES)
+            writeTailLocked();
+
+        return offset;
+
+    }
+
+    // Copy the length bytes at offset to dest
+    void read(uint64_t offset, int length, char *dest) {
+
+        if (offset + length > tailStart.load(memory_order_acquire)) {
+
+            lock_guard<mutex> lock(tailMutex);
+            if (offset >= tailStart) {
+                if (offset + length > tailStart + tail.size())
+                    throw runtime_error("HeapFile: record is past the end of the heap file");
+                memcpy(dest, &tail[offset - tailStart], length);
+                return;
+            }
+
+        }
+
+        ssize_t bytesRead = pread(fd, dest, length, offset);
+        if (bytesRead != length)
+            throw runtime_error("HeapFile: could not read heap file");
+
+        ioCounters.pageReads.fetch_add(1, memory_order_relaxed);
+        ioCounters.bytesRead.fetch_add(length, memory_order_relaxed);
+
+    }
+
+    // Hand the tail to the OS
+    void flush() {
+        lock_guard<mutex> lock(tailMutex);
+        if (!tail.empty())
+            writeTailLocked();
+    }
+
+    // flush() and wait until the OS has the file on disk (nothing to do if nothing was appended since the last sync)
+    void sync() {
+
+        lock_guard<mutex> lock(tailMutex);
+        if (!tail.empty())
+            writeTailLocked();
+
+        if (syncedBytes == tailStart)
+            return;
+
+        if (fsync(fd) != 0)
+            throw runtime_error("HeapFile: could not sync heap file");
+        syncedBytes = tailStart;
+        ioCounters.syncs.fetch_add(1, memory_order_relaxed);
+
+    }
+};
+
+// Lets a write-ahead log (see WriteAheadLog) follow pages through the buffer pool
+// Called with the pool's lock held
+class PageWriteHook {
+public:
+    virtual ~PageWriteHook() {}
+
+    // A page was unpinned dirty, data is its new contents
+    virtual void pageChanged(int pageIdx, const char *data) = 0;
+
+    // A dirty page is about to be written back to the index file
+    // Returns false if it must not reach the file yet (the frame is dropped without writing it)
+    virtual bool beforeWriteBack(int pageIdx) = 0;
+
+    // Copy in the contents of a page whose write back was held back, returns false if there are none
+    virtual bool readHeldBack(int pageIdx, char *dest) = 0;
+};
+
+// Page cache that sits in front of the index file. Every block access in the index
+// goes through fetchPage()/unpinPage() so a bucket that was touched on the previous
+// insert is served from memory instead of being seeked to and re-read from disk.
+// Frames are pinned while in use, tracked as dirty when modified and only written back
+// to the index file when they are evicted (CLOCK replacement) or explicitly flushed.
+// When the page file is memory mapped there is nothing to cache, so pages are handed
+// out straight from the mapping and the frames go unused.
+class BufferPool {
+private:
+    const int PAGE_SIZE;
+
+    struct Frame {
+        int pageIdx;        // Physical page index held by the frame (-1 if frame is empty)
+        int pinCount;       // Number of users currently holding the page
+        bool dirty;         // Page was modified since it was read in
+        bool referenced;    // CLOCK reference bit (second chance)
+        vector<char> data;  // PAGE_SIZE bytes of page contents
+    };
+
+    PageFile *pageFile;
+    PageWriteHook *writeHook;
+    vector<Frame> frames;
+
+    // Maps physical page index to the frame it currently lives in
+    unordered_map<int, int> pageTable;
+
+    // Current position of the CLOCK hand
+    int clockHand;
+
+    // Guards the frame table so pages can be fetched from several threads at once
+    // (contents of a pinned page are protected by the bucket latches of the index, not by this)
+    mutex poolMutex;
+
+    // Fetches served from a frame / that had to read the page, and pages evicted to make room
+    // (changed under poolMutex, atomic so they can be read without it)
+    atomic<uint64_t> cacheHits{0};
+    atomic<uint64_t> cacheMisses{0};
+    atomic<uint64_t> evictions{0};
+
+    // Write frame contents back to its page in the index file
+    void writeBack(Frame &frame) {
+        if (writeHook == nullptr || writeHook->beforeWriteBack(frame.pageIdx))
+            pageFile->writePage(frame.pageIdx, frame.data.data());
+        frame.dirty = false;
+    }
+
+    // Pick a frame to hold a new page using the CLOCK algorithm:
+    // sweep the frames, skipping pinned ones and giving referenced ones a second chance
+    // Dirty victims are written back before the frame is handed out
+    int findVictim() {
+
+        int numFrames = frames.size();
+
+        // Two full sweeps are enough to clear every reference bit once
+        for (int sweep = 0; sweep < 2 * numFrames; sweep++) {
+
+            int frameIdx = clockHand;
+            clockHand = (clockHand + 1) % numFrames;
+
+            Frame &frame = frames[frameIdx];
+
+            if (frame.pageIdx == -1)
+                return frameIdx;
+
+            if (frame.pinCount > 0)
+                continue;
+
+            if (frame.referenced) {
+                frame.referenced = false;
+                continue;
+            }
+
+            // Evict page currently in the frame
+            if (frame.dirty)
+                writeBack(frame);
+
+            pageTable.erase(frame.pageIdx);
+            frame.pageIdx = -1;
+            evictions.fetch_add(1, memory_order_relaxed);
+
+            return frameIdx;
+
+        }
+
+        throw runtime_error("BufferPool: all frames are pinned");
+
+    }
+
+    // Shared logic for fetchPage() and newPage(), returns frame holding page (pinned)
+    Frame &pinFrame(int pageIdx, bool readFromDisk) {
+
+        auto it = pageTable.find(pageIdx);
+
+        // Cache hit
+        if (it != pageTable.end()) {
+            Frame &frame = frames[it->second];
+            frame.pinCount++;
+            frame.referenced = true;
+            if (readFromDisk)
+                cacheHits.fetch_add(1, memory_order_relaxed);
+            return frame;
+        }
+
+        // Cache miss, find a frame and bring the page in
+        int frameIdx = findVictim();
+        Frame &frame = frames[frameIdx];
+
+        if (readFromDisk) {
+            cacheMisses.fetch_add(1, memory_order_relaxed);
+            if (writeHook == nullptr || !writeHook->readHeldBack(pageIdx, frame.data.data()))
+                pageFile->readPage(pageIdx, frame.data.data());
+        }
+        else
+            memset(frame.data.data(), 0, PAGE_SIZE);
+
+        frame.pageIdx = pageIdx;
+        frame.pinCount = 1;
+        frame.dirty = false;
+        frame.referenced = true;
+        pageTable[pageIdx] = frameIdx;
+
+        return frame;
+
+    }
+
+public:
+    BufferPool(int numFrames, int pageSize = DEFAULT_PAGE_SIZE) : PAGE_SIZE(pageSize) {
+
+        pageFile = nullptr;
+        writeHook = nullptr;
+        clockHand = 0;
+
+        // Need at least a parent and child block pinned at once
+        if (numFrames < 2)
+            numFrames = 2;
+
+        frames.resize(numFrames);
+        for (Frame &frame : frames) {
+            frame.pageIdx = -1;
+            frame.pinCount = 0;
+            frame.dirty = false;
+            frame.referenced = false;
+            frame.data.resize(PAGE_SIZE);
+        }
+
+    }
+
+    // Point the pool at an (already opened) index file
+    // Any cached pages belong to the old file so they are dropped
+    void attach(PageFile &file) {
+
+        reset();
+        pageFile = &file;
+
+    }
+
+    // Have hook see every page change and write back from now on (nullptr to stop)
+    void setWriteHook(PageWriteHook *hook) {
+        lock_guard<mutex> lock(poolMutex);
+        writeHook = hook;
+    }
+
+    // Return pinned pointer to contents of existing page, reading it from disk if not cached
+    char *fetchPage(int pageIdx) {
+
+        char *mapped = pageFile->pagePointer(pageIdx);
+        if (mapped != nullptr)
+            return mapped;
+
+        lock_guard<mutex> lock(poolMutex);
+        return pinFrame(pageIdx, true).data.data();
+
+    }
+
+    // Return pinned pointer to a freshly allocated page (zero filled, nothing is read from disk)
+    // The page may still be cached from before it was freed, so a cached copy is zeroed too
+    char *newPage(int pageIdx) {
+
+        char *mapped = pageFile->pagePointer(pageIdx);
+        if (mapped != nullptr) {
+            memset(mapped, 0, PAGE_SIZE);
+            return mapped;
+        }
+
+        lock_guard<mutex> lock(poolMutex);
+        Frame &frame = pinFrame(pageIdx, false);
+        memset(frame.data.data(), 0, PAGE_SIZE);
+        frame.dirty = true;
+        return frame.data.data();
+
+    }
+
+    // Release page, marking it dirty if caller modified it
+    void unpinPage(int pageIdx, bool isDirty) {
+
+        lock_guard<mutex> lock(poolMutex);
+        auto it = pageTable.find(pageIdx);
+        if (it == pageTable.end())
+            return;
+
+        Frame &frame = frames[it->second];
+        if (frame.pinCount > 0)
+            frame.pinCount--;
+        if (isDirty) {
+            frame.dirty = true;
+            if (writeHook != nullptr)
+                writeHook->pageChanged(pageIdx, frame.data.data());
+        }
+
+    }
+
+    // Write page back to disk if it is dirty (page stays cached)
+    void flushPage(int pageIdx) {
+
+        lock_guard<mutex> lock(poolMutex);
+        auto it = pageTable.find(pageIdx);
+        if (it != pageTable.end() && frames[it->second].dirty)
+            writeBack(frames[it->second]);
+
+    }
+
+    // Write every dirty page back to disk
+    void flushAll() {
+
+        lock_guard<mutex> lock(poolMutex);
+        if (pageFile == nullptr)
+            return;
+
+        for (Frame &frame : frames) {
+            if (frame.pageIdx != -1 && frame.dirty)
+                writeBack(frame);
+        }
+
+        pageFile->flush();
+
+    }
+
+    // Hit/miss/eviction counts since the pool was created (only fetchPage() counts, and only for cached
+    // backends: a mapped file has no cache misses the pool could see)
+    uint64_t numCacheHits() const {
+        return cacheHits.load(memory_order_relaxed);
+    }
+
+    uint64_t numCacheMisses() const {
+        return cacheMisses.load(memory_order_relaxed);
+    }
+
+    uint64_t numEvictions() const {
+        return evictions.load(memory_order_relaxed);
+    }
+
+    void resetCounters() {
+        cacheHits = 0;
+        cacheMisses = 0;
+        evictions = 0;
+    }
+
+    // Flush and empty the pool
+    void reset() {
+
+        flushAll();
+
+        lock_guard<mutex> lock(poolMutex);
+        for (Frame &frame : frames) {
+            frame.pageIdx = -1;
+            frame.pinCount = 0;
+            frame.dirty = false;
+            frame.referenced = false;
+        }
+        pageTable.clear();
+        clockHand = 0;
+
+    }
+};
+
+// When the write-ahead log is forced to disk
+enum WalSyncPolicy {
+    WAL_SYNC_EVERY_COMMIT,  // fsync before every insert/delete/update returns
+    WAL_SYNC_GROUP,         // commits are buffered and fsynced together once enough are waiting or the oldest
+                            // has waited long enough (a crash loses at most that group, never half an operation)
+    WAL_SYNC_NONE           // log is handed to the OS on every commit but never fsynced (survives the
+                            // process crashing, not the machine)
+};
+
+// Redo log of the index. Each insert/delete/update is one log record holding the after-image of every
+// page it changed (blocks, free list pages, header and directory pages), so after a crash the index file
+// is brought up to its last committed operation by writing those images again, and an operation is never
+// half applied. Log records are:
+//
+//   magic | payload length | checksum of payload | payload
+//
+// where the payload is the # of pages and then per page: page idx, start and length of the longest run of
+// zero bytes in the page (left out of the log) and the rest of the page.
+// Since the log can only redo, pages of the operation in progress are kept out of the index file (if the
+// buffer pool has to evict one, its image is held here until the commit writes it), and the log is on disk
+// before any committed page is written back. A checkpoint writes everything back to the index file and
+// empties the log.
+class WriteAheadLog : public PageWriteHook {
+private:
+    const int PAGE_SIZE;
+    static constexpr uint32_t RECORD_MAGIC = 0x524C4157; // "WALR"
+    static constexpr int RECORD_HEADER_SIZE = 3 * sizeof(uint32_t);
+
+    int fd;
+    PageFile *pageFile;
+
+    WalSyncPolicy syncPolicy;
+    int groupCommitSize;
+    chrono::microseconds groupCommitDelay;
+
+    // Guards everything below, pages can be evicted (and so written back) from reader threads too
+    mutex walMutex;
+
+    // Pages changed by the operation in progress (latest image of each), and the ones the pool evicted
+    bool inOperation;
+    unordered_map<int, vector<char>> operationPages;
+    vector<int> heldBackPages;
+
+    // Committed records that haven't been written to the log file yet
+    vector<char> logBuffer;
+    size_t fileBytes;
+
+    // Called before commits are written out and synced, so whatever they refer to outside the
+    // index file is on disk first (the heap file of IndexOptions::separatePayloads)
+    function<void()> beforeSync;
+
+    // Commits not on disk yet and when the oldest of them committed
+    int pendingCommits;
+    chrono::steady_clock::time_point oldestPendingCommit;
+
+    // With WAL_SYNC_GROUP a background thread syncs a group once its oldest commit has waited groupCommitDelay,
+    // so commits aren't left in logBuffer when no further commit comes along to sync them
+    thread flusher;
+    condition_variable flusherWake;
+    bool stopFlusher;
+
+    static uint32_t checksum(const char *data, size_t length) {
+
+        // 32 bit FNV-1a
+        uint32_t hashVal = 2166136261u;
+        for (size_t b = 0; b < length; b++) {
+            hashVal ^= (unsigned char)data[b];
+            hashVal *= 16777619u;
+        }
+        return hashVal;
+
+    }
+
+    static void appendInt(vector<char> &out, int value) {
+        size_t oldSize = out.size();
+        out.resize(oldSize + sizeof(value));
+        memcpy(&out[oldSize], &value, sizeof(value));
+    }
+
+    // Append page idx, zero run and the rest of the page to a record payload
+    void encodePage(vector<char> &out, int pageIdx, const char *data) {
+
+        int runStart = 0, runLength = 0;
+        for (int b = 0; b < PAGE_SIZE; ) {
+
+            if (data[b] != 0) {
+                b++;
+                continue;
+            }
+
+            int start = b;
+            while (b < PAGE_SIZE && data[b] == 0)
+                b++;
+
+            if (b - start > runLength) {
+                runStart = start;
+                runLength = b - start;
+            }
+
+        }
+
+        appendInt(out, pageIdx);
+        appendInt(out, runStart);
+        appendInt(out, runLength);
+        out.insert(out.end(), data, data + runStart);
+        out.insert(out.end(), data + runStart + runLength, data + PAGE_SIZE);
+
+    }
+
+    // Hand everything in logBuffer to the OS
+    void writeOut() {
+
+        size_t written = 0;
+        while (written < logBuffer.size()) {
+            ssize_t result = ::write(fd, logBuffer.data() + written, logBuffer.size() - written);
+            if (result < 0)
+                throw runtime_error("WriteAheadLog: could not write log file");
+            written += result;
+        }
+
+        fileBytes += logBuffer.size();
+        logBuffer.clear();
+
+    }
+
+    // Make every commit so far durable (as durable as the sync policy goes)
+    void syncLocked() {
+
+        if (syncPolicy != WAL_SYNC_NONE && pendingCommits > 0 && beforeSync)
+            beforeSync();
+
+        writeOut();
+
+        if (syncPolicy != WAL_SYNC_NONE && pendingCommits > 0 && fsync(fd) != 0)
+            throw runtime_error("WriteAheadLog: could not sync log file");
+
+        pendingCommits = 0;
+
+    }
+
+    void flusherLoop() {
+
+        unique_lock<mutex> lock(walMutex);
+
+        while (!stopFlusher) {
+
+            if (pendingCommits == 0) {
+                flusherWake.wait(lock);
+                continue;
+            }
+
+            auto deadline = oldestPendingCommit + groupCommitDelay;
+            if (chrono::steady_clock::now() < deadline) {
+                flusherWake.wait_until(lock, deadline);
+                continue;
+            }
+
+            // Errors are left to the next commit, which tries the sync again and throws to its caller
+            try {
+                syncLocked();
+            }
+            catch (const exception &e) {
+                LHI_LOG(LOG_ERROR, e.what() << ", log flusher stopped");
+                return;
+            }
+
+        }
+
+    }
+
+    void stopFlusherThread() {
+
+        if (!flusher.joinable())
+            return;
+
+        {
+            lock_guard<mutex> lock(walMutex);
+            stopFlusher = true;
+        }
+        flusherWake.notify_one();
+        flusher.join();
+
+    }
+
+public:
+    WriteAheadLog(WalSyncPolicy policy, int groupSize, int groupDelayMicros, int pageSize = DEFAULT_PAGE_SIZE)
+        : PAGE_SIZE(pageSize) {
+        fd = -1;
+        pageFile = nullptr;
+        syncPolicy = policy;
+        groupCommitSize = max(1, groupSize);
+        groupCommitDelay = chrono::microseconds(groupDelayMicros);
+        inOperation = false;
+        fileBytes = 0;
+        pendingCommits = 0;
+        stopFlusher = false;
+    }
+
+    ~WriteAheadLog() {
+        close();
+    }
+
+    // Open (and optionally empty) the log file, creating it if needed
+    bool open(const string &fileName, bool truncate) {
+
+        close();
+
+        int flags = O_RDWR | O_CREAT | O_APPEND;
+        if (truncate)
+            flags |= O_TRUNC;
+
+        fd = ::open(fileName.c_str(), flags, 0644);
+        if (fd < 0)
+            return false;
+
+        struct stat fileStat;
+        fstat(fd, &fileStat);
+        fileBytes = fileStat.st_size;
+
+        if (syncPolicy == WAL_SYNC_GROUP) {
+            stopFlusher = false;
+            flusher = thread(&WriteAheadLog::flusherLoop, this);
+        }
+
+        return true;
+
+    }
+
+    // Whatever hasn't been written out is dropped (same as a crash)
+    void close() {
+
+        stopFlusherThread();
+
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+        logBuffer.clear();
+        pendingCommits = 0;
+
+    }
+
+    // Index file that held back pages are written to once they are committed
+    void attach(PageFile &file) {
+        pageFile = &file;
+    }
+
+    // Have callback run (with the log locked) every time commits are about to be synced
+    void setBeforeSync(function<void()> callback) {
+        lock_guard<mutex> lock(walMutex);
+        beforeSync = std::move(callback);
+    }
+
+    // Bytes in the log (written out or not)
+    size_t size() {
+        lock_guard<mutex> lock(walMutex);
+        return fileBytes + logBuffer.size();
+    }
+
+    // Start collecting page changes of a new operation (anything left from an operation that never
+    // committed is dropped)
+    void beginOperation() {
+        lock_guard<mutex> lock(walMutex);
+        inOperation = true;
+        operationPages.clear();
+        heldBackPages.clear();
+    }
+
+    // Log every page the operation changed as one record, then sync according to the policy
+    void commitOperation() {
+
+        lock_guard<mutex> lock(walMutex);
+
+        inOperation = false;
+        if (operationPages.empty())
+            return;
+
+        vector<char> payload;
+        appendInt(payload, operationPages.size());
+        for (auto &page : operationPages)
+            encodePage(payload, page.first, page.second.data());
+
+        uint32_t recordHeader[3] = {RECORD_MAGIC, (uint32_t)payload.size(), checksum(payload.data(), payload.size())};
+        logBuffer.insert(logBuffer.end(), (const char *)recordHeader, (const char *)recordHeader + RECORD_HEADER_SIZE);
+        logBuffer.insert(logBuffer.end(), payload.begin(), payload.end());
+
+        if (pendingCommits == 0) {
+            oldestPendingCommit = chrono::steady_clock::now();
+            flusherWake.notify_one();
+        }
+        pendingCommits++;
+
+        // Pages the pool had to evict during the operation can go to the index file now that
+        // they are committed, as soon as the log says so
+        if (!heldBackPages.empty()) {
+            syncLocked();
+            for (int pageIdx : heldBackPages)
+                pageFile->writePage(pageIdx, operationPages[pageIdx].data());
+            heldBackPages.clear();
+        }
+
+        operationPages.clear();
+
+        if (syncPolicy == WAL_SYNC_EVERY_COMMIT || syncPolicy == WAL_SYNC_NONE ||
+            pendingCommits >= groupCommitSize ||
+            chrono::steady_clock::now() - oldestPendingCommit >= groupCommitDelay)
+            syncLocked();
+
+    }
+
+    // Force all commits so far to disk
+    void sync() {
+        lock_guard<mutex> lock(walMutex);
+        syncLocked();
+    }
+
+    // Drop the whole log (after a checkpoint or when the index file is recreated)
+    void truncate() {
+
+        lock_guard<mutex> lock(walMutex);
+
+        logBuffer.clear();
+        pendingCommits = 0;
+
+        if (ftruncate(fd, 0) != 0)
+            throw runtime_error("WriteAheadLog: could not truncate log file");
+        fileBytes = 0;
+
+    }
+
+    // Write the pages of every complete record in the log to file (before anything reads it),
+    // stopping at the first record that is torn or corrupt, then sync file and empty the log
+    // Returns the number of operations replayed
+    int recover(PageFile &file) {
+
+        lock_guard<mutex> lock(walMutex);
+
+        vector<char> log(fileBytes);
+        size_t bytesRead = 0;
+        while (bytesRead < log.size()) {
+            ssize_t result = pread(fd, log.data() + bytesRead, log.size() - bytesRead, bytesRead);
+            if (result <= 0)
+                break;
+            bytesRead += result;
+        }
+        log.resize(bytesRead);
+
+        int numReplayed = 0;
+        size_t offset = 0;
+        vector<char> page(PAGE_SIZE);
+
+        while (offset + RECORD_HEADER_SIZE <= log.size()) {
+
+            uint32_t recordHeader[3];
+            memcpy(recordHeader, &log[offset], RECORD_HEADER_SIZE);
+
+            const char *payload = &log[offset + RECORD_HEADER_SIZE];
+            size_t payloadLength = recordHeader[1];
+
+            if (recordHeader[0] != RECORD_MAGIC || payloadLength > log.size() - offset - RECORD_HEADER_SIZE ||
+                checksum(payload, payloadLength) != recordHeader[2])
+                break;
+
+            int numPages;
+            memcpy(&numPages, payload, sizeof(numPages));
+            const char *pos = payload + sizeof(numPages);
+
+            for (int p = 0; p < numPages; p++) {
+
+                int pageIdx, runStart, runLength;
+                memcpy(&pageIdx, pos, sizeof(pageIdx));
+                memcpy(&runStart, pos + sizeof(int), sizeof(runStart));
+                memcpy(&runLength, pos + 2 * sizeof(int), sizeof(runLength));
+                pos += 3 * sizeof(int);
+
+                memcpy(page.data(), pos, runStart);
+                memset(page.data() + runStart, 0, runLength);
+                memcpy(page.data() + runStart + runLength, pos + runStart, PAGE_SIZE - runStart - runLength);
+                pos += PAGE_SIZE - runLength;
+
+                file.writePage(pageIdx, page.data());
+
+            }
+
+            numReplayed++;
+            offset += RECORD_HEADER_SIZE + payloadLength;
+
+        }
+
+        file.sync();
+
+        logBuffer.clear();
+        pendingCommits = 0;
+        if (ftruncate(fd, 0) != 0)
+            throw runtime_error("WriteAheadLog: could not truncate log file");
+        fileBytes = 0;
+
+        return numReplayed;
+
+    }
+
+    void pageChanged(int pageIdx, const char *data) override {
+
+        lock_guard<mutex> lock(walMutex);
+        if (inOperation)
+            operationPages[pageIdx].assign(data, data + PAGE_SIZE);
+
+    }
+
+    bool beforeWriteBack(int pageIdx) override {
+
+        lock_guard<mutex> lock(walMutex);
+
+        // Not committed yet, the image stays here until commitOperation()
+        if (inOperation && operationPages.count(pageIdx)) {
+            if (find(heldBackPages.begin(), heldBackPages.end(), pageIdx) == heldBackPages.end())
+                heldBackPages.push_back(pageIdx);
+            return false;
+        }
+
+        // Write ahead: the page may hold changes of commits that are only in logBuffer
+        if (pendingCommits > 0 || !logBuffer.empty())
+            syncLocked();
+
+        return true;
+
+    }
+
+    bool readHeldBack(int pageIdx, char *dest) override {
+
+        lock_guard<mutex> lock(walMutex);
+
+        if (!inOperation || find(heldBackPages.begin(), heldBackPages.end(), pageIdx) == heldBackPages.end())
+            return false;
+
+        memcpy(dest, operationPages[pageIdx].data(), PAGE_SIZE);
+        return true;
+
+    }
+};
+
+// Finds a 32 bit tag in a column of tags (the key tags of a SlottedPage) with the widest compare the CPU has:
+// AVX2 compares 8 tags at a time, SSE2 4 and the fallback loop 1. The CPU is checked the first time a tag is
+// looked for, so the header builds without -mavx2 and the same binary runs on CPUs with or without it
+class TagMatcher {
+private:
+    using FindFunction = int (*)(const char *, int, uint32_t);
+
+    static FindFunction select() {
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return findAvx2;
+#endif
+#ifdef __SSE2__
+        return findSse2;
+#else
+        return findScalar;
+#endif
+
+    }
+
+public:
+    // Index of the first of the count tags starting at tags that equals tag, count if none does
+    // (tags are read with unaligned loads)
+    static int find(const char *tags, int count, uint32_t tag) {
+        static const FindFunction chosen = select();
+        return chosen(tags, count, tag);
+    }
+
+    // Which of the versions below find() uses
+    static const char *name() {
+        FindFunction chosen = select();
+        return chosen == findScalar ? "scalar" : chosen == findAvx2 ? "avx2" : "sse2";
+    }
+
+    static int findScalar(const char *tags, int count, uint32_t tag) {
+
+        for (int pos = 0; pos < count; pos++) {
+            uint32_t stored;
+            memcpy(&stored, tags + pos * sizeof(uint32_t), sizeof(stored));
+            if (stored == tag)
+                return pos;
+        }
+
+        return count;
+
+    }
+
+#ifdef __SSE2__
+    static int findSse2(const char *tags, int count, uint32_t tag) {
+
+        __m128i wanted = _mm_set1_epi32((int)tag);
+        int pos = 0;
+
+        for (; pos + 4 <= count; pos += 4) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(tags + pos * sizeof(uint32_t)));
+            int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(chunk, wanted)));
+            if (mask != 0)
+                return pos + __builtin_ctz(mask);
+        }
+
+        return pos + findScalar(tags + pos * sizeof(uint32_t), count - pos, tag);
+
+    }
+#else
+    static int findSse2(const char *tags, int count, uint32_t tag) {
+        return findScalar(tags, count, tag);
+    }
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    __attribute__((target("avx2")))
+    static int findAvx2(const char *tags, int count, uint32_t tag) {
+
+        __m256i wanted = _mm256_set1_epi32((int)tag);
+        int pos = 0;
+
+        for (; pos + 8 <= count; pos += 8) {
+            __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(tags + pos * sizeof(uint32_t)));
+            int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(chunk, wanted)));
+            if (mask != 0)
+                return pos + __builtin_ctz(mask);
+        }
+
+        return pos + findSse2(tags + pos * sizeof(uint32_t), count - pos, tag);
+
+    }
+#else
+    static int findAvx2(const char *tags, int count, uint32_t tag) {
+        return findSse2(tags, count, tag);
+    }
+#endif
+};
+
+// Slotted page layout shared by every block in the index file:
+//
+//   overflow pointer | # of records | free space pointer | offsets | key tags ...  free space  ... records
+//
+// The header is 3 fixed 4 byte ints. Each slot is the offset of one record in the offset column and a
+// 32 bit tag of its key (see LinearHashIndex::keyTag()) in the tag column right after it, 8 bytes in all.
+// The slot columns grow forward from the header while records are packed backwards from the end of the
+// page, so the free space is always the gap between the two and is known in O(1), and a record can be
+// jumped to directly through its slot without parsing the ones before it. Records lie back to back in slot
+// order (slot 0 at the end of the page), so a record's length is the distance to the one of the slot before.
+// A key is looked for by comparing its tag against the whole tag column at once (see TagMatcher), only
+// slots whose tag matches have their record looked at.
+class SlottedPage {
+public:
+    static constexpr int HEADER_SIZE = 3 * sizeof(int);
+    static constexpr int SLOT_SIZE = sizeof(int) + sizeof(uint32_t);
+
+    char *data;
+    int pageSize;
+
+    SlottedPage(char *page, int size) {
+        data = page;
+        pageSize = size;
+    }
+
+    // Write header of a fresh empty page
+    void init() {
+        setOverflowPtr(-1);
+        setNumRecords(0);
+        setFreeSpacePtr(pageSize);
+    }
+
+    int overflowPtr() const { return readInt(0); }
+    int numRecords() const { return readInt(sizeof(int)); }
+    int freeSpacePtr() const { return readInt(2 * sizeof(int)); }
+
+    void setOverflowPtr(int idx) { writeInt(0, idx); }
+    void setNumRecords(int n) { writeInt(sizeof(int), n); }
+    void setFreeSpacePtr(int offset) { writeInt(2 * sizeof(int), offset); }
+
+    // Bytes left between the end of the slot columns and the start of the record data
+    int freeSpace() const {
+        return freeSpacePtr() - (HEADER_SIZE + numRecords() * SLOT_SIZE);
+    }
+
+    // Bytes taken by the header, the slots and the records
+    int usedBytes() const {
+        return pageSize - freeSpace();
+    }
+
+    int slotOffset(int slot) const { return readInt(HEADER_SIZE + slot * sizeof(int)); }
+    int slotLength(int slot) const { return (slot == 0 ? pageSize : slotOffset(slot - 1)) - slotOffset(slot); }
+
+    const char *recordData(int slot) const { return data + slotOffset(slot); }
+
+    // Start of the tag column
+    const char *tags() const { return data + HEADER_SIZE + numRecords() * sizeof(int); }
+
+    uint32_t slotTag(int slot) const {
+        uint32_t tag;
+        memcpy(&tag, tags() + slot * sizeof(uint32_t), sizeof(tag));
+        return tag;
+    }
+
+    // First slot from fromSlot on whose tag is tag, numRecords() if there is none
+    int findTag(uint32_t tag, int fromSlot = 0) const {
+        return fromSlot + TagMatcher::find(tags() + fromSlot * sizeof(uint32_t), numRecords() - fromSlot, tag);
+    }
+
+    // Reserve room for a record of recordLength bytes with key tag tag and add a slot for it
+    // (the tag column moves up one offset to make room in the offset column)
+    // Returns pointer to write the record to, or nullptr if the record doesn't fit
+    char *allocRecord(int recordLength, uint32_t tag) {
+
+        if (freeSpace() < recordLength + SLOT_SIZE)
+            return nullptr;
+
+        int slot = numRecords();
+        int offset = freeSpacePtr() - recordLength;
+        char *tagColumn = data + HEADER_SIZE + slot * sizeof(int);
+
+        memmove(tagColumn + sizeof(int), tagColumn, slot * sizeof(uint32_t));
+        writeInt(HEADER_SIZE + slot * sizeof(int), offset);
+        memcpy(tagColumn + sizeof(int) + slot * sizeof(uint32_t), &tag, sizeof(tag));
+        setFreeSpacePtr(offset);
+        setNumRecords(slot + 1);
+
+        return data + offset;
+
+    }
+
+    // Take the record in slot out of the page. Records packed in front of it slide up to close the
+    // gap and the slots after it move down one, so the remaining records keep their order
+    void removeRecord(int slot) {
+
+        int offset = slotOffset(slot);
+        int length = slotLength(slot);
+        int freePtr = freeSpacePtr();
+        int count = numRecords();
+
+        memmove(data + freePtr + length, data + freePtr, offset - freePtr);
+
+        // Records of later slots are the ones that moved
+        for (int s = slot + 1; s < count; s++)
+            writeInt(HEADER_SIZE + s * sizeof(int), slotOffset(s) + length);
+
+        // Close the gap in the offset column (which takes the tag column along), then in the tag column
+        char *slotOffsetData = data + HEADER_SIZE + slot * sizeof(int);
+        memmove(slotOffsetData, slotOffsetData + sizeof(int), (count - slot - 1) * sizeof(int) + count * sizeof(uint32_t));
+
+        char *slotTagData = data + HEADER_SIZE + (count - 1) * sizeof(int) + slot * sizeof(uint32_t);
+        memmove(slotTagData, slotTagData + sizeof(uint32_t), (count - slot - 1) * sizeof(uint32_t));
+
+        setNumRecords(count - 1);
+        setFreeSpacePtr(freePtr + length);
+
+    }
+
+private:
+    int readInt(int offset) const {
+        int value;
+        memcpy(&value, data + offset, sizeof(value));
+        return value;
+    }
+
+    void writeInt(int offset, int value) {
+        memcpy(data + offset, &value, sizeof(value));
+    }
+};
+
+// Reader/writer latch guarding one bucket chain. It is only 4 bytes so every bucket can have its own:
+// state > 0 is the number of readers holding it, -1 means the writer holds it. A waiting writer adds
+// WRITER_PENDING so no new readers get in ahead of it. Meant for the single writer of the index, not
+// for several writers competing for the same latch.
+class BucketLatch {
+private:
+    static constexpr int WRITER_PENDING = 1 << 30;
+    atomic<int> state;
+
+public:
+    BucketLatch() : state(0) {}
+
+    void lockShared() {
+        while (true) {
+            int current = state.load(memory_order_relaxed);
+            if (current >= 0 && current < WRITER_PENDING &&
+                state.compare_exchange_weak(current, current + 1, memory_order_acquire))
+                return;
+            this_thread::yield();
+        }
+    }
+
+    void unlockShared() {
+        state.fetch_sub(1, memory_order_release);
+    }
+
+    void lock() {
+        state.fetch_add(WRITER_PENDING, memory_order_relaxed);
+        while (true) {
+            int expected = WRITER_PENDING;
+            if (state.compare_exchange_weak(expected, -1, memory_order_acquire))
+                return;
+            this_thread::yield();
+        }
+    }
+
+    void unlock() {
+        state.store(0, memory_order_release);
+    }
+};
+
+// Page directory of the index (bucket index -> physical page of its base block) plus the latch of
+// every bucket. Entries live in fixed size segments that are never moved or freed while the index
+// exists, so a reader can look at an entry while the writer is adding buckets without the storage
+// being reallocated underneath it (which a vector<int> would do on push_back).
+class PageDirectory {
+private:
+    static constexpr int SEGMENT_BITS = 14;
+    static constexpr int SEGMENT_SIZE = 1 << SEGMENT_BITS;
+    static constexpr int MAX_SEGMENTS = 1 << 14;
+
+    struct Entry {
+        atomic<int> pageIdx;
+        BucketLatch latch;
+    };
+
+    unique_ptr<atomic<Entry *>[]> segments;
+    atomic<int> numEntries;
+    int numSegments;
+
+    Entry &entry(int idx) const {
+        return segments[idx >> SEGMENT_BITS].load(memory_order_acquire)[idx & (SEGMENT_SIZE - 1)];
+    }
+
+public:
+    PageDirectory() : segments(new atomic<Entry *>[MAX_SEGMENTS]), numEntries(0), numSegments(0) {
+        for (int seg = 0; seg < MAX_SEGMENTS; seg++)
+            segments[seg].store(nullptr);
+    }
+
+    ~PageDirectory() {
+        for (int seg = 0; seg < numSegments; seg++)
+            delete[] segments[seg].load();
+    }
+
+    int size() const {
+        return numEntries.load(memory_order_acquire);
+    }
+
+    int operator[](int idx) const {
+        return entry(idx).pageIdx.load(memory_order_acquire);
+    }
+
+    void set(int idx, int pageIdx) {
+        entry(idx).pageIdx.store(pageIdx, memory_order_release);
+    }
+
+    // Drop the last entry (its segment and latch stay around for readers still looking at it)
+    void pop_back() {
+        numEntries.store(numEntries.load(memory_order_relaxed) - 1, memory_order_release);
+    }
+
+    BucketLatch &latch(int idx) {
+        return entry(idx).latch;
+    }
+
+    void push_back(int pageIdx) {
+
+        int idx = numEntries.load(memory_order_relaxed);
+
+        if ((idx >> SEGMENT_BITS) >= numSegments) {
+            if (numSegments == MAX_SEGMENTS)
+                throw runtime_error("PageDirectory: too many buckets");
+            segments[numSegments].store(new Entry[SEGMENT_SIZE], memory_order_release);
+            numSegments++;
+        }
+
+        set(idx, pageIdx);
+        numEntries.store(idx + 1, memory_order_release);
+
+    }
+
+    // Segments are kept around so concurrent readers never touch freed memory
+    void clear() {
+        numEntries.store(0, memory_order_release);
+    }
+
+    void assign(int count, int pageIdx) {
+        clear();
+        for (int idx = 0; idx < count; idx++)
+            push_back(pageIdx);
+    }
+};
+
+// How the index file is accessed (see PageFile)
+enum StorageBackend {
+    STREAM_BACKEND,     // fstream reads/writes through the buffer pool
+    MMAP_BACKEND        // file is mmapped and pages are used in place
+};
+
+// When an insert splits the next bucket (linear hashing splits buckets in order, whichever bucket
+// the insert went to)
+enum SplitPolicy {
+    SPLIT_ON_UTILIZATION,   // the average bucket holds more than splitThreshold of a page (the original trigger)
+    SPLIT_ON_OVERFLOW,      // the insert had to add an overflow block
+    SPLIT_ON_CHAIN_LENGTH   // the insert landed past the first maxChainLength blocks of its chain
+};
+
+// Construction time settings of a LinearHashIndex
+struct IndexOptions {
+    StorageBackend backend = STREAM_BACKEND;
+
+    // Number of pages the buffer pool keeps in memory (3 reproduces the original
+    // 3 blocks in main memory limit), unused by the mmap backend
+    int numFrames = 64;
+
+    // Log every insert/delete/update to <index file>.wal so the index survives a crash (see WriteAheadLog)
+    // Only works with the stream backend, the mmap backend can't keep uncommitted pages out of the file
+    bool writeAheadLog = false;
+    WalSyncPolicy walSyncPolicy = WAL_SYNC_GROUP;
+    int walGroupCommitSize = 32;        // commits per fsync with WAL_SYNC_GROUP
+    int walGroupCommitMicros = 5000;    // or once the oldest waiting commit is this old
+
+    // Checkpoint (write everything back to the index file and empty the log) once the log is this big
+    size_t walCheckpointBytes = (size_t)64 << 20;
+
+    // Time every insert, lookup and split for the latency percentiles of metrics()
+    // (two clock reads per operation, turn off to shave them off the hot paths)
+    bool trackLatencies = true;
+
+    // Bytes per page (block) of the index file, a power of two from 1K to 1M. Stored in the index file,
+    // which can only be opened again with the same page size. Records much bigger than a few percent of
+    // a page waste the tail of every block (three 1K records fill a 4K page to 75%), 16K or 64K pages
+    // pack them better
+    int pageSize = DEFAULT_PAGE_SIZE;
+
+    // Split trigger (see SplitPolicy) and fill factors, as fractions of a page
+    SplitPolicy splitPolicy = SPLIT_ON_UTILIZATION;
+    double splitThreshold = 0.7;    // SPLIT_ON_UTILIZATION, and the fill the bulk loaders size buckets for
+    double mergeThreshold = 0.5;    // deletes undo splits once the average bucket is under this
+    int maxChainLength = 2;         // SPLIT_ON_CHAIN_LENGTH
+
+    // Compress records as they are written (bios for employees, see EmployeeSerializer::compress()), for
+    // serializers that can. More records fit in a page, so chains are shorter and lookups read fewer pages;
+    // a lookup only decompresses the record it returns. Records are flagged one by one, so an index can be
+    // reopened with or without it
+    bool compressRecords = false;
+
+    // Keep only the keys in the bucket pages: each slot holds a directory entry (the key and where the
+    // record is) and the records themselves go to the append only <index file>.heap (see HeapFile).
+    // A page then covers hundreds of keys however big the records are, so chains stay short, and a hit costs one
+    // more read, of its record in the heap. Space of deleted and replaced records is given back by compact().
+    // Stored in the index file, which can only be opened again with the same setting
+    bool separatePayloads = false;
+
+    // Keep a secondary index on the serializer's SecondaryKey (manager_id for employees) in
+    // <index file>.secondary, for findBySecondaryKey(). Built with the same options as the index
+    bool secondaryIndex = false;
+};
+
+// Snapshot of the shape of an index (see LinearHashIndex::stats())
+struct IndexStats {
+    int pageSize = DEFAULT_PAGE_SIZE;
+    int numBuckets = 0;
+    int numBlocks = 0;
+    int numOverflowBlocks = 0;
+    int numFreePages = 0;
+    int numRecords = 0;
+    double avgBucketCapacity = 0;       // average bytes per bucket as a fraction of a page
+    int numPages = 0;                   // pages of the index file in use (header, directory, blocks and free pages)
+};
+
+// Printed the way the builds always reported their results
+inline ostream &operator<<(ostream &out, const IndexStats &stats) {
+    out << "----------------------------------------------------------------------------\n";
+    out << "[FINAL STATS]\n";
+    out << "# of buckets: " << stats.numBuckets << "\n";
+    out << "# of blocks: " << stats.numBlocks << "\n";
+    out << "# of overflow blocks: " << stats.numOverflowBlocks << "\n";
+    out << "# of free pages: " << stats.numFreePages << "\n";
+    out << "# of records: " << stats.numRecords << "\n";
+    out << "Average capacity per bucket (decimal percentage): " << stats.avgBucketCapacity << "\n";
+    out << "----------------------------------------------------------------------------";
+    return out;
+}
+
+// Percentiles of a LatencyHistogram, all in nanoseconds
+struct LatencySummary {
+    uint64_t count = 0;
+    double mean = 0;
+    uint64_t p50 = 0;
+    uint64_t p90 = 0;
+    uint64_t p99 = 0;
+    uint64_t p999 = 0;
+    uint64_t max = 0;
+};
+
+// Latencies (in nanoseconds) bucketed log-linearly: every power of two is cut into 8 sub-buckets, so a
+// percentile is within 12.5% of the real one. Recording is a few relaxed atomic adds, no lock, so
+// concurrent lookups can all record into the same histogram.
+class LatencyHistogram {
+private:
+    static constexpr int SUB_BUCKET_BITS = 3;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static constexpr int NUM_BUCKETS = 64 * SUB_BUCKETS;
+
+    atomic<uint64_t> counts[NUM_BUCKETS];
+    atomic<uint64_t> total{0};
+    atomic<uint64_t> sumNs{0};
+    atomic<uint64_t> maxNs{0};
+
+    static int bucketOf(uint64_t ns) {
+
+        if (ns < SUB_BUCKETS)
+            return ns;
+
+        // Top SUB_BUCKET_BITS bits below the most significant one pick the sub-bucket
+        int msb = 63 - __builtin_clzll(ns);
+        int subBucket = (ns >> (msb - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+        return (msb - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + subBucket;
+
+    }
+
+    // Largest latency that lands in bucket
+    static uint64_t bucketUpperBound(int bucket) {
+
+        if (bucket < SUB_BUCKETS)
+            return bucket;
+
+        int msb = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+        uint64_t lower = (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << (msb - SUB_BUCKET_BITS);
+        return lower + ((uint64_t)1 << (msb - SUB_BUCKET_BITS)) - 1;
+
+    }
+
+    uint64_t percentile(double fraction) const {
+
+        uint64_t numRecorded = total.load(memory_order_relaxed);
+        uint64_t target = max<uint64_t>(1, ceil(fraction * numRecorded));
+        uint64_t seen = 0;
+
+        for (int bucket = 0; bucket < NUM_BUCKETS; bucket++) {
+            seen += counts[bucket].load(memory_order_relaxed);
+            if (seen >= target)
+                return min(bucketUpperBound(bucket), maxNs.load(memory_order_relaxed));
+        }
+
+        return maxNs.load(memory_order_relaxed);
+
+    }
+
+public:
+    LatencyHistogram() {
+        reset();
+    }
+
+    void record(uint64_t ns) {
+
+        counts[bucketOf(ns)].fetch_add(1, memory_order_relaxed);
+        total.fetch_add(1, memory_order_relaxed);
+        sumNs.fetch_add(ns, memory_order_relaxed);
+
+        uint64_t currentMax = maxNs.load(memory_order_relaxed);
+        while (ns > currentMax && !maxNs.compare_exchange_weak(currentMax, ns, memory_order_relaxed)) {}
+
+    }
+
+    // Counters are read one at a time, so a summary taken while operations are recording may be a
+    // few operations out of step (fine for monitoring)
+    LatencySummary summary() const {
+
+        LatencySummary result;
+        result.count = total.load(memory_order_relaxed);
+        if (result.count == 0)
+            return result;
+
+        result.mean = (double)sumNs.load(memory_order_relaxed) / result.count;
+        result.p50 = percentile(0.5);
+        result.p90 = percentile(0.9);
+        result.p99 = percentile(0.99);
+        result.p999 = percentile(0.999);
+        result.max = maxNs.load(memory_order_relaxed);
+
+        return result;
+
+    }
+
+    void reset() {
+        for (atomic<uint64_t> &count : counts)
+            count.store(0, memory_order_relaxed);
+        total = 0;
+        sumNs = 0;
+        maxNs = 0;
+    }
+};
+
+// Records the time from its construction to its destruction into histogram (nothing if histogram is nullptr)
+class ScopedLatency {
+private:
+    LatencyHistogram *histogram;
+    chrono::steady_clock::time_point start;
+
+public:
+    ScopedLatency(LatencyHistogram *timedHistogram) : histogram(timedHistogram) {
+        if (histogram != nullptr)
+            start = chrono::steady_clock::now();
+    }
+
+    ~ScopedLatency() {
+        if (histogram != nullptr)
+            histogram->record(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    }
+
+    ScopedLatency(const ScopedLatency &) = delete;
+    ScopedLatency &operator=(const ScopedLatency &) = delete;
+};
+
+// Everything LinearHashIndex::metrics() reports, see toJson() for the exported form
+struct IndexMetrics {
+    IndexStats shape;
+
+    // Index file I/O (see IoCounters) and buffer pool behavior
+    uint64_t pageReads = 0;
+    uint64_t pageWrites = 0;
+    uint64_t bytesRead = 0;
+    uint64_t bytesWritten = 0;
+    uint64_t syncs = 0;
+    uint64_t cacheHits = 0;
+    uint64_t cacheMisses = 0;
+    uint64_t evictions = 0;
+
+    // Heap file reads and size, with IndexOptions::separatePayloads
+    uint64_t heapReads = 0;
+    uint64_t heapBytesRead = 0;
+    uint64_t heapBytes = 0;
+
+    // Structural changes
+    uint64_t numSplits = 0;
+    uint64_t numMerges = 0;
+
+    // chainLengthHistogram[k] is the number of buckets whose chain is k blocks long (index 0 is unused)
+    vector<int> chainLengthHistogram;
+
+    LatencySummary splitLatency;
+    LatencySummary insertLatency;
+    LatencySummary lookupLatency;
+
+    double cacheHitRate() const {
+        uint64_t fetches = cacheHits + cacheMisses;
+        return fetches == 0 ? 0 : (double)cacheHits / fetches;
+    }
+
+    string toJson() const {
+
+        ostringstream json;
+
+        auto latencyJson = [&json](const LatencySummary &latency) {
+            json << "{\"count\": " << latency.count << ", \"mean\": " << latency.mean
+                 << ", \"p50\": " << latency.p50 << ", \"p90\": " << latency.p90 << ", \"p99\": " << latency.p99
+                 << ", \"p999\": " << latency.p999 << ", \"max\": " << latency.max << "}";
+        };
+
+        json << "{\n";
+        json << "  \"pageSize\": " << shape.pageSize << ",\n";
+        json << "  \"buckets\": " << shape.numBuckets << ",\n";
+        json << "  \"blocks\": " << shape.numBlocks << ",\n";
+        json << "  \"overflowBlocks\": " << shape.numOverflowBlocks << ",\n";
+        json << "  \"freePages\": " << shape.numFreePages << ",\n";
+        json << "  \"pages\": " << shape.numPages << ",\n";
+        json << "  \"records\": " << shape.numRecords << ",\n";
+        json << "  \"avgBucketCapacity\": " << shape.avgBucketCapacity << ",\n";
+        json << "  \"pageReads\": " << pageReads << ",\n";
+        json << "  \"pageWrites\": " << pageWrites << ",\n";
+        json << "  \"bytesRead\": " << bytesRead << ",\n";
+        json << "  \"bytesWritten\": " << bytesWritten << ",\n";
+        json << "  \"syncs\": " << syncs << ",\n";
+        json << "  \"cacheHits\": " << cacheHits << ",\n";
+        json << "  \"cacheMisses\": " << cacheMisses << ",\n";
+        json << "  \"cacheHitRate\": " << cacheHitRate() << ",\n";
+        json << "  \"evictions\": " << evictions << ",\n";
+        json << "  \"heapReads\": " << heapReads << ",\n";
+        json << "  \"heapBytesRead\": " << heapBytesRead << ",\n";
+        json << "  \"heapBytes\": " << heapBytes << ",\n";
+        json << "  \"splits\": " << numSplits << ",\n";
+        json << "  \"merges\": " << numMerges << ",\n";
+
+        // Keyed by chain length, lengths no bucket has are left out
+        json << "  \"chainLengthHistogram\": {";
+        bool first = true;
+        for (size_t length = 1; length < chainLengthHistogram.size(); length++) {
+            if (chainLengthHistogram[length] == 0)
+                continue;
+            json << (first ? "" : ", ") << "\"" << length << "\": " << chainLengthHistogram[length];
+            first = false;
+        }
+        json << "},\n";
+
+        json << "  \"splitLatencyNs\": ";
+        latencyJson(splitLatency);
+        json << ",\n  \"insertLatencyNs\": ";
+        latencyJson(insertLatency);
+        json << ",\n  \"lookupLatencyNs\": ";
+        latencyJson(lookupLatency);
+        json << "\n}";
+
+        return json.str();
+
+    }
+};
+
+// Hash functions the index can be built with (the HashPolicy parameter of LinearHashIndex).
+// Each maps a 64 bit key to a 64 bit hash, the index uses its last i bits, so the hash has to mix well
+// into the low bits. ID is stored in the header page so a file is only opened with the hash it was built with.
+
+// Original hash of the index (id mod 2^16): only 16 bits, so there is nothing left to split on past
+// 65536 buckets, and keys that differ by a multiple of 2^16 always collide. Kept to compare against
+struct ModuloHash {
+    static constexpr int ID = 0;
+    static constexpr const char *NAME = "modulo";
+
+    static uint64_t hash(uint64_t key) {
+        return key & 0xFFFF;
+    }
+};
+
+// Finalizer (fmix64) of MurmurHash3, two multiply-xorshift rounds
+struct Murmur3Hash {
+    static constexpr int ID = 1;
+    static constexpr const char *NAME = "murmur3";
+
+    static uint64_t hash(uint64_t key) {
+        key ^= key >> 33;
+        key *= 0xFF51AFD7ED558CCDULL;
+        key ^= key >> 33;
+        key *= 0xC4CEB9FE1A85EC53ULL;
+        key ^= key >> 33;
+        return key;
+    }
+};
+
+// wyhash style: 64x64 -> 128 bit multiply of the key mixed with wyhash's secrets, folding the
+// high half back into the low half
+struct WyHash {
+    static constexpr int ID = 2;
+    static constexpr const char *NAME = "wyhash";
+
+    static uint64_t mix(uint64_t a, uint64_t b) {
+        unsigned __int128 product = (unsigned __int128)a * b;
+        return (uint64_t)product ^ (uint64_t)(product >> 64);
+    }
+
+    static uint64_t hash(uint64_t key) {
+        return mix(mix(key ^ 0xA0761D6478BD642FULL, 0xE7037ED1A0B428DBULL), 0x8EBC6AF09C88C6E3ULL ^ 8);
+    }
+};
+
+// xxh3 style: the keyed rrmxmx avalanche XXH3 uses for 4 to 8 byte inputs
+struct Xxh3Hash {
+    static constexpr int ID = 3;
+    static constexpr const char *NAME = "xxh3";
+
+    static uint64_t rotl(uint64_t x, int r) {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    static uint64_t hash(uint64_t key) {
+        uint64_t h = ((key >> 32) | (key << 32)) ^ 0xC73AB174C5ECD5A2ULL;
+        h ^= rotl(h, 49) ^ rotl(h, 24);
+        h *= 0x9FB21C651E98DF25ULL;
+        h ^= (h >> 35) + 8;
+        h *= 0x9FB21C651E98DF25ULL;
+        return h ^ (h >> 28);
+    }
+};
+
+// Linear hash index over records of type Rec keyed by Key (see KeyCodec and EmployeeSerializer for
+// what Serializer has to provide), placed with HashPolicy. The defaults are the Employee index.
+template <class Key = int, class Rec = Record, class Serializer = EmployeeSerializer, class HashPolicy = Murmur3Hash>
+class LinearHashIndex;
+
+// Entry of a secondary index: the secondary key of a record and the primary key of the record
+template <class SecondaryKey, class PrimaryKey>
+struct SecondaryEntry {
+    SecondaryKey key;
+    PrimaryKey primaryKey;
+};
+
+// Serializer of secondary index entries: the secondary key in KeyCodec format (so the secondary index
+// hashes and probes on it like on any key) followed by the primary key. Any number of entries can
+// have the same secondary key.
+template <class SecondaryKey, class PrimaryKey>
+struct SecondaryEntrySerializer {
+    using Entry = SecondaryEntry<SecondaryKey, PrimaryKey>;
+    using KeyFormat = KeyCodec<SecondaryKey>;
+    using PrimaryKeyFormat = KeyCodec<PrimaryKey>;
+
+    // An encoded entry still sitting in a page
+    struct View {
+        const char *data;
+        int length;
+    };
+
+    static SecondaryKey key(const Entry &entry) {
+        return entry.key;
+    }
+
+    static int encodedSize(const Entry &entry) {
+        return KeyFormat::encodedSize(entry.key) + PrimaryKeyFormat::encodedSize(entry.primaryKey);
+    }
+
+    static int write(const Entry &entry, char *dest) {
+        int keyLength = KeyFormat::encodedSize(entry.key);
+        KeyFormat::write(entry.key, dest);
+        PrimaryKeyFormat::write(entry.primaryKey, dest + keyLength);
+        return keyLength + PrimaryKeyFormat::encodedSize(entry.primaryKey);
+    }
+
+    static View view(const char *data, int length) {
+        return View{data, length};
+    }
+
+    static Entry read(const char *data, int /*length*/) {
+        SecondaryKey key = KeyFormat::read(data);
+        return Entry{key, PrimaryKeyFormat::read(data + KeyFormat::encodedSize(key))};
+    }
+
+    static SecondaryKey key(const View &view) {
+        return KeyFormat::read(view.data);
+    }
+
+    static int encodedSize(const View &view) {
+        return view.length;
+    }
+
+    static int write(const View &view, char *dest) {
+        memcpy(dest, view.data, view.length);
+        return view.length;
+    }
+};
+
+template <class Serializer>
+concept HasSecondaryKey = requires { typename Serializer::SecondaryKey; };
+
+template <class Serializer>
+concept HasCompression = requires(const typename Serializer::View &view, vector<char> &buffer) {
+    Serializer::compress(view, buffer);
+};
+
+// Type of the secondary index a LinearHashIndex keeps for its Serializer: another linear hash index
+// (same hash function) from secondary keys to primary keys, or NoSecondaryIndex if there is no secondary key
+struct NoSecondaryIndex {};
+
+template <class Key, class Serializer, class HashPolicy>
+struct SecondaryIndexOf {
+    using SecondaryKey = Key;
+    using type = NoSecondaryIndex;
+};
+
+template <class Key, class Serializer, class HashPolicy>
+    requires HasSecondaryKey<Serializer>
+struct SecondaryIndexOf<Key, Serializer, HashPolicy> {
+    using SecondaryKey = typename Serializer::SecondaryKey;
+    using type = LinearHashIndex<SecondaryKey, SecondaryEntry<SecondaryKey, Key>,
+                                 SecondaryEntrySerializer<SecondaryKey, Key>, HashPolicy>;
+};
+
+template <class Key, class Rec, class Serializer, class HashPolicy>
+class LinearHashIndex {
+
+    // The secondary index is a LinearHashIndex of another type that the index drives directly
+    template <class, class, class, class>
+    friend class LinearHashIndex;
+
+private:
+    using Codec = KeyCodec<Key>;
+    using View = typename Serializer::View;
+    using SecondaryKey = typename SecondaryIndexOf<Key, Serializer, HashPolicy>::SecondaryKey;
+    using SecondaryIndex = typename SecondaryIndexOf<Key, Serializer, HashPolicy>::type;
+
+    // Page size and split settings of this index (see IndexOptions)
+    const int PAGE_SIZE;
+    const SplitPolicy SPLIT_POLICY;
+
+    // A bucket is split off once the average bytes per bucket goes over this fraction of a page
+    // (with SPLIT_ON_UTILIZATION, the other policies only use it to size bulk builds and to cap merges)
+    const double SPLIT_THRESHOLD;
+
+    // and the last split is undone once deletes bring it under this fraction
+    const double MERGE_THRESHOLD;
+
+    // SPLIT_ON_CHAIN_LENGTH splits once an insert lands past this many blocks of its chain
+    const int MAX_CHAIN_LENGTH;
+
+    PageDirectory pageDirectory;  // Where pageDirectory[h(id)] gives page index of block
+                                // can scan to pages using index*PAGE_SIZE as offset (using seek function)
+    int numBlocks; // Now is actual count of blocks including overflow
+
+    // determines the index for page directory (index value of bucket which the last i bits need to match)
+    // the page directory then returns an index which is technically in offset into the actual file to read
+    // an abstract arbitrary block in index file.
+    atomic<int> numBuckets; // buckets are not the same as blocks (bucket point to block, block hold records) // n
+    atomic<int> i;
+    int numRecords; // Records in index
+    int nextFreePage; // Next page to write to (end of the file)
+    mutex pageAllocMutex; // Guards nextFreePage and the free list when pages are allocated from several threads
+
+    // Pages given up by splits are kept in a free list and handed out again before the file grows.
+    // A free page only holds the physical index of the next free page (-1 ends the list)
+    int freeListHead;
+    int numFreePages;
+
+    // Lookups can run on any number of threads while one thread inserts:
+    // - writerMutex makes sure there is only ever one writer
+    // - the writer holds the latch of a bucket (in pageDirectory) exclusively while changing its chain,
+    //   readers hold it shared while walking the chain
+    // - directoryVersion is a sequence lock around changes to numBuckets, i and the directory:
+    //   it is odd while the writer is changing them. A reader picks its bucket from a snapshot of
+    //   (n, i), latches it and then checks the version again, retrying if a split got in between.
+    //   A split keeps both buckets it touches latched until its records are moved, so readers of
+    //   those two buckets wait for it while readers of any other bucket never do.
+    mutex writerMutex;
+    atomic<uint64_t> directoryVersion;
+
+    // Scans hold structureMutex shared for as long as they run, so no bucket is split or merged under them
+    // (every record that stays in the index is seen exactly once). The writer only try-locks it: splits that
+    // come due while a scan is running are counted in pendingSplits and done by the first write (or flush())
+    // after the last scan is over, merges are skipped until then
+    shared_mutex structureMutex;
+    int pendingSplits;
+    string fName; // Name of output index file
+
+    // Index file stays open for the lifetime of the index so cached pages
+    // in the buffer pool stay valid between inserts and lookups
+    unique_ptr<PageFile> indexFile;
+    BufferPool bufferPool;
+
+    // Heap file holding the records when pages only hold directory entries (see IndexOptions::separatePayloads),
+    // nullptr if records are in the pages. Declared before wal, whose flusher thread syncs it
+    unique_ptr<HeapFile> heap;
+
+    // Write-ahead log, nullptr if the index isn't logged
+    unique_ptr<WriteAheadLog> wal;
+    size_t walCheckpointBytes;
+
+    // Records are compressed as they are written (see IndexOptions::compressRecords)
+    bool compressRecords;
+
+    // Secondary index (see IndexOptions::secondaryIndex), nullptr if there is none
+    // Every record has one entry (secondary key -> primary key) in it, so it is untouched by the splits and
+    // merges of this index, which move records between pages but never change their keys
+    unique_ptr<SecondaryIndex> secondary;
+
+    // Operation counters and latencies reported by metrics()
+    // (the histograms are only fed when IndexOptions::trackLatencies is set)
+    bool trackLatencies;
+    LatencyHistogram insertLatency;
+    LatencyHistogram lookupLatency;
+    LatencyHistogram splitLatency;
+    atomic<uint64_t> numSplits{0};
+    atomic<uint64_t> numMerges{0};
+
+    // Histogram to time an operation into, nullptr if latencies aren't tracked (see ScopedLatency)
+    LatencyHistogram *timedBy(LatencyHistogram &histogram) {
+        return trackLatencies ? &histogram : nullptr;
+    }
+
+    // Bookkeeping vars for debugging and statistics
+    int numOverflowBlocks;
+
+    // Vars for calculating average number of records per block
+    // (64 bit, the bytes of a big index add up past 2 GiB)
+    int64_t currentTotalSize;
+
+    // Page 0 of the index file is the header page holding everything above
+    // (split state, counters, ...) so an existing index file can be reopened
+    // without rebuilding it. The page directory itself is too big for the header
+    // so it lives in a chain of directory pages:
+    // next directory page idx (-1 if last), # of entries, then the entries
+    static constexpr uint32_t INDEX_MAGIC = 0x5848494C; // "LHIX"
+    static constexpr int INDEX_VERSION = 7;
+    static constexpr int HEADER_PAGE_IDX = 0;
+
+    // Physical indexes of the pages holding the page directory (in chain order)
+    vector<int> directoryPages;
+
+    // Hand out count physically contiguous new pages, returns index of the first one
+    // A single page comes off the free list if there is one, runs of pages are always taken
+    // from the end of the file since free pages are scattered
+    // Thread safe so bulk build workers can allocate their bucket chains concurrently
+    int allocatePages(int count) {
+
+        lock_guard<mutex> lock(pageAllocMutex);
+
+        if (count == 1 && freeListHead != -1) {
+
+            int pgIdx = freeListHead;
+
+            const char *page = bufferPool.fetchPage(pgIdx);
+            memcpy(&freeListHead, page, sizeof(freeListHead));
+            bufferPool.unpinPage(pgIdx, false);
+
+            numFreePages--;
+            return pgIdx;
+
+        }
+
+        int firstPage = nextFreePage;
+        nextFreePage += count;
+        return firstPage;
+
+    }
+
+    int allocatePage() {
+        return allocatePages(1);
+    }
+
+    // Give a page that is no longer part of any chain back to the free list
+    // (the page is zeroed apart from the link to the next free page)
+    void freePage(int pgIdx) {
+
+        lock_guard<mutex> lock(pageAllocMutex);
+
+        char *page = bufferPool.newPage(pgIdx);
+        memcpy(page, &freeListHead, sizeof(freeListHead));
+        bufferPool.unpinPage(pgIdx, true);
+
+        freeListHead = pgIdx;
+        numFreePages++;
+
+    }
+
+    // Bracket changes to numBuckets, i and the directory for concurrent readers
+    void beginDirectoryChange() {
+        directoryVersion.fetch_add(1, memory_order_acq_rel);
+    }
+
+    void endDirectoryChange() {
+        directoryVersion.fetch_add(1, memory_order_acq_rel);
+    }
+
+    // Latch the bucket id currently belongs to for reading, returns its index
+    // (caller unlatches with pageDirectory.latch(bucketIdx).unlockShared())
+    int latchBucketForRead(const Key &id) {
+
+        while (true) {
+
+            uint64_t version = directoryVersion.load(memory_order_acquire);
+            if (version & 1) {
+                this_thread::yield();
+                continue;
+            }
+
+            int bucketIdx = getBucketIdx(id);
+
+            // (n, i) may have been read half way through a split, only trust bucketIdx if nothing changed
+            if (directoryVersion.load(memory_order_acquire) != version)
+                continue;
+
+            BucketLatch &latch = pageDirectory.latch(bucketIdx);
+            latch.lockShared();
+
+            if (directoryVersion.load(memory_order_acquire) == version)
+                return bucketIdx;
+
+            latch.unlockShared();
+
+        }
+
+    }
+
+    // Reset in memory state to an empty index (page 0 is reserved for the header)
+    void resetState() {
+        pageDirectory.clear();
+        directoryPages.clear();
+        numBlocks = 0;
+        i = 0;
+        numRecords = 0;
+        numBuckets = 0;
+        numOverflowBlocks = 0;
+        currentTotalSize = 0;
+        nextFreePage = HEADER_PAGE_IDX + 1;
+        freeListHead = -1;
+        numFreePages = 0;
+        pendingSplits = 0;
+    }
+
+    // Write header page and page directory pages through the buffer pool
+    // Directory pages are allocated once and reused on every later write,
+    // more are only added when the directory outgrows them
+    // Directory pages holding only entries before firstChangedBucket are left alone
+    void writeMetadata(int firstChangedBucket = 0) {
+
+        int entriesPerDirPage = (PAGE_SIZE - 2 * sizeof(int)) / sizeof(int);
+        int dirPagesNeeded = (pageDirectory.size() + entriesPerDirPage - 1) / entriesPerDirPage;
+        int firstChangedDirPage = firstChangedBucket / entriesPerDirPage;
+
+        while ((int)directoryPages.size() < dirPagesNeeded) {
+
+            // Last page so far gets a next pointer to the new one
+            firstChangedDirPage = min(firstChangedDirPage, max(0, (int)directoryPages.size() - 1));
+
+            int dirPage = allocatePage();
+            bufferPool.newPage(dirPage);
+            bufferPool.unpinPage(dirPage, true);
+            directoryPages.push_back(dirPage);
+
+        }
+
+        // Write directory entries, chaining pages together
+        for (int d = firstChangedDirPage; d < (int)directoryPages.size(); d++) {
+
+            int nextDirPage = (d + 1 < (int)directoryPages.size()) ? directoryPages[d + 1] : -1;
+            int firstEntry = d * entriesPerDirPage;
+            int numEntries = max(0, min(entriesPerDirPage, (int)pageDirectory.size() - firstEntry));
+
+            char *page = bufferPool.fetchPage(directoryPages[d]);
+            memcpy(page, &nextDirPage, sizeof(nextDirPage));
+            memcpy(page + sizeof(int), &numEntries, sizeof(numEntries));
+            for (int entry = 0; entry < numEntries; entry++) {
+                int pgIdx = pageDirectory[firstEntry + entry];
+                memcpy(page + (2 + entry) * sizeof(int), &pgIdx, sizeof(pgIdx));
+            }
+            bufferPool.unpinPage(directoryPages[d], true);
+
+        }
+
+        // Header page fields are written in a fixed order (see readMetadata()), followed by the 64 bit total size
+        int dirHeadPage = directoryPages.empty() ? -1 : directoryPages[0];
+        int headerFields[] = {INDEX_VERSION, PAGE_SIZE, numBuckets.load(), i.load(), numRecords, nextFreePage,
+                              numBlocks, numOverflowBlocks, dirHeadPage, freeListHead, numFreePages,
+                              HashPolicy::ID, heap ? 1 : 0};
+
+        char *header = bufferPool.newPage(HEADER_PAGE_IDX);
+        memcpy(header, &INDEX_MAGIC, sizeof(INDEX_MAGIC));
+        memcpy(header + sizeof(INDEX_MAGIC), headerFields, sizeof(headerFields));
+        memcpy(header + sizeof(INDEX_MAGIC) + sizeof(headerFields), &currentTotalSize, sizeof(currentTotalSize));
+        bufferPool.unpinPage(HEADER_PAGE_IDX, true);
+
+    }
+
+    // Page size recorded in the header page of the open index file, -1 if it has no valid header
+    // (the header fields all fit in the first 1K, so they can be read whatever the file's page size)
+    int storedPageSize() {
+
+        vector<char> header(PAGE_SIZE);
+        indexFile->readPage(HEADER_PAGE_IDX, header.data());
+
+        uint32_t magic;
+        int headerFields[2];
+        memcpy(&magic, header.data(), sizeof(magic));
+        memcpy(headerFields, header.data() + sizeof(magic), sizeof(headerFields));
+
+        return (magic == INDEX_MAGIC && headerFields[0] == INDEX_VERSION) ? headerFields[1] : -1;
+
+    }
+
+    // Load header page and page directory of an existing index file
+    // Returns false if the file doesn't look like an index written by writeMetadata()
+    bool readMetadata() {
+
+        const char *header = bufferPool.fetchPage(HEADER_PAGE_IDX);
+
+        uint32_t magic;
+        int headerFields[13];
+        int64_t totalSize;
+        memcpy(&magic, header, sizeof(magic));
+        memcpy(headerFields, header + sizeof(magic), sizeof(headerFields));
+        memcpy(&totalSize, header + sizeof(magic) + sizeof(headerFields), sizeof(totalSize));
+        bufferPool.unpinPage(HEADER_PAGE_IDX, false);
+
+        if (magic != INDEX_MAGIC || headerFields[0] != INDEX_VERSION || headerFields[1] != PAGE_SIZE)
+            return false;
+
+        // Records were placed with a different hash function
+        if (headerFields[11] != HashPolicy::ID)
+            return false;
+
+        // Pages hold directory entries or whole records
+        if (headerFields[12] != (heap ? 1 : 0))
+            return false;
+
+        numBuckets = headerFields[2];
+        i = headerFields[3];
+        numRecords = headerFields[4];
+        nextFreePage = headerFields[5];
+        numBlocks = headerFields[6];
+        numOverflowBlocks = headerFields[7];
+        currentTotalSize = totalSize;
+        freeListHead = headerFields[9];
+        numFreePages = headerFields[10];
+
+        // Walk the directory page chain
+        pageDirectory.clear();
+        directoryPages.clear();
+        int dirPage = headerFields[8];
+
+        while (dirPage != -1) {
+
+            const char *page = bufferPool.fetchPage(dirPage);
+
+            int nextDirPage, numEntries;
+            memcpy(&nextDirPage, page, sizeof(nextDirPage));
+            memcpy(&numEntries, page + sizeof(int), sizeof(numEntries));
+
+            for (int entry = 0; entry < numEntries; entry++) {
+                int pgIdx;
+                memcpy(&pgIdx, page + (2 + entry) * sizeof(int), sizeof(pgIdx));
+                pageDirectory.push_back(pgIdx);
+            }
+
+            bufferPool.unpinPage(dirPage, false);
+
+            directoryPages.push_back(dirPage);
+            dirPage = nextDirPage;
+
+        }
+
+        return (int)pageDirectory.size() == numBuckets;
+
+    }
+
+    // A view as it gets written to a page: compressed by the serializer if compress is set (into buffer,
+    // which has to outlive the view returned), otherwise as it is
+    static View storedForm(const View &record, bool compress, vector<char> &buffer) {
+
+        if constexpr (HasCompression<Serializer>) {
+            if (compress)
+                return Serializer::compress(record, buffer);
+        }
+
+        return record;
+
+    }
+
+    // Bytes that go into a page as they are: a directory entry (see HeapPointer)
+    struct EncodedRecord {
+        const char *data;
+        int length;
+    };
+
+    // Encode a record into a page (RecordLike here and below is either a Rec or a View, which the Serializer
+    // can both encode, or an EncodedRecord)
+    template <class RecordLike>
+    static int encodedSize(const RecordLike &record) {
+        return Serializer::encodedSize(record);
+    }
+
+    static int encodedSize(const EncodedRecord &record) {
+        return record.length;
+    }
+
+    template <class RecordLike>
+    static void writeEncoded(const RecordLike &record, char *dest) {
+        Serializer::write(record, dest);
+    }
+
+    static void writeEncoded(const EncodedRecord &record, char *dest) {
+        memcpy(dest, record.data, record.length);
+    }
+
+    // Bytes a record adds to a block: the encoded record plus its slot
+    template <class RecordLike>
+    static int recordSize(const RecordLike &record) {
+        return encodedSize(record) + SlottedPage::SLOT_SIZE;
+    }
+
+    // With separate payloads a slot holds a directory entry instead of the record: the key the way the encoded
+    // record starts with it (so splits, merges and key compares work on entries like on records), then where the
+    // record is in the heap file. The key's fingerprint is its slot's tag, like for any record (see keyTag())
+    struct HeapPointer {
+        uint64_t offset;
+        int length;
+    };
+
+    static constexpr int HEAP_POINTER_SIZE = sizeof(uint64_t) + sizeof(int);
+
+    // HeapPointer at the end of a directory entry
+    static HeapPointer heapPointerOf(const char *entryData, int entryLength) {
+
+        const char *pointerData = entryData + entryLength - HEAP_POINTER_SIZE;
+
+        HeapPointer pointer;
+        memcpy(&pointer.offset, pointerData, sizeof(pointer.offset));
+        memcpy(&pointer.length, pointerData + sizeof(uint64_t), sizeof(pointer.length));
+
+        return pointer;
+
+    }
+
+    // Directory entry of the encoded record that was appended to the heap at offset, written to entry
+    static void makeDirectoryEntry(const char *recordData, int recordLength, uint64_t offset, vector<char> &entry) {
+
+        int keyLength = Codec::encodedSize(Codec::read(recordData));
+
+        entry.resize(keyLength + HEAP_POINTER_SIZE);
+        char *pointerData = entry.data() + keyLength;
+        memcpy(entry.data(), recordData, keyLength);
+        memcpy(pointerData, &offset, sizeof(offset));
+        memcpy(pointerData + sizeof(uint64_t), &recordLength, sizeof(recordLength));
+
+    }
+
+    // Encoded record behind a slot: the slot's bytes, or with separate payloads the record its directory entry
+    // points at, read from the heap into buffer. recordLength goes in as the slot's length and comes out as the record's
+    const char *resolveRecord(const char *slotData, int &recordLength, vector<char> &buffer) {
+
+        if (!heap)
+            return slotData;
+
+        HeapPointer pointer = heapPointerOf(slotData, recordLength);
+        buffer.resize(pointer.length);
+        heap->read(pointer.offset, pointer.length, buffer.data());
+        recordLength = pointer.length;
+
+        return buffer.data();
+
+    }
+
+    // Bytes a record adds to a block of this index: recordSize(), or with separate payloads the size of its directory entry
+    template <class RecordLike>
+    int storedSize(const RecordLike &record) {
+        if (heap)
+            return Codec::encodedSize(Serializer::key(record)) + HEAP_POINTER_SIZE + SlottedPage::SLOT_SIZE;
+        return recordSize(record);
+    }
+
+    int storedSize(const EncodedRecord &record) {
+        return recordSize(record);
+    }
+
+    // Hash function (see HashPolicy)
+    uint64_t hash(const Key &id) {
+        return HashPolicy::hash(Codec::hashInput(id));
+    }
+
+    // Hash of the key of an encoded record
+    uint64_t hashStored(const char *recordData) {
+        return HashPolicy::hash(Codec::storedHashInput(recordData));
+    }
+
+    // Tag of a key in the tag column of a page (see SlottedPage): what the key feeds the hash function folded to
+    // 32 bits, which is the key itself for integer keys that fit in 32 bits and a fingerprint of string keys.
+    // It doesn't depend on the hash function, so it tells keys of one bucket apart whichever bits pick the bucket
+    static uint32_t foldTag(uint64_t hashInput) {
+        return (uint32_t)hashInput ^ (uint32_t)(hashInput >> 32);
+    }
+
+    static uint32_t keyTag(const Key &id) {
+        return foldTag(Codec::hashInput(id));
+    }
+
+    // of the key of an encoded record (or directory entry)
+    static uint32_t storedKeyTag(const char *recordData) {
+        return foldTag(Codec::storedHashInput(recordData));
+    }
+
+    template <class RecordLike>
+    static uint32_t recordTag(const RecordLike &record) {
+        return keyTag(Serializer::key(record));
+    }
+
+    static uint32_t recordTag(const EncodedRecord &record) {
+        return storedKeyTag(record.data);
+    }
+
+    // Function to get last i'th bits of hash value
+    int getLastIthBits(uint64_t hashVal, int i) {
+        return (int)(hashVal & ((1ULL << i) - 1));
+    }
+
+    // Bucket a search key lives in: last i'th bits of its hash, with the MSB set back
+    // to 0 if that lands on a ghost bucket (>= n) that hasn't been split off yet
+    int getBucketIdx(const Key &id) {
+
+        int bucketIdx = getLastIthBits(hash(id), i);
+        if (bucketIdx >= numBuckets)
+            bucketIdx &= ~(1 << (i-1));
+
+        return bucketIdx;
+
+    }
+
+    // Initializes a bucket/block
+    // Block format is a slotted page (see SlottedPage): overflow pointer (integer offset index to
+    // overflow block in index file), number of records, free space pointer, slot array and then records
+    // For creating entirely new buckets, not for overflow blocks in existing bucket
+    // Return LOGICAL BUCKET index (not physical offset index!!!!)
+    int initBucket() {
+
+        // Pre-write slotted page header to the blocks at the buckets
+        // Default overflow pointer value is -1 (since we don't overflow yet), and number of records is 0 for empty block
+        int pgIdx = allocatePage();
+        SlottedPage page(bufferPool.newPage(pgIdx), PAGE_SIZE);
+        page.init();
+        bufferPool.unpinPage(pgIdx, true);
+
+        // Bucket index is based on number of blocks starting at 0
+        // update numBuckets when creating buckets
+        // We want to have phys index based on # of blocks because we can allocate more blocks outside
+        // of this function and so we want the latest free block index for the bucket
+        // # of bucket probably < # of blocks most of the time, so if we allocate phys idx by # of buckets
+        // we would allocate an already used phys idx most likely
+        pageDirectory.push_back(pgIdx);
+        numBlocks++;
+        numBuckets++;
+
+        // Update current total size
+        currentTotalSize += SlottedPage::HEADER_SIZE;
+
+        return pageDirectory.size() - 1;
+        
+    }
+
+    // Create overflow block (we DON'T ADD TO PAGE DIRECTORY SINCE NOT NEW BUCKET!) on existing bucket
+    // We also need to overwrite the overflow index pointer of the block that points
+    // to this overflow block
+    // Returns physical offset index of overflow block
+    int initOverflowBlock(int parentBlockIdx) {
+
+        // Get index of current overflow block
+        int currIdx = allocatePage();
+
+        // Write boilerplate block info (overflow index to NEXT OVERFLOW BLOCK, # of records, free space)
+        // which are initial values since this is fresh overflow block
+        SlottedPage page(bufferPool.newPage(currIdx), PAGE_SIZE);
+        page.init();
+        bufferPool.unpinPage(currIdx, true);
+
+        // Rewrite parent block's overflow index to point to this current index to link parent to current
+        SlottedPage parentPage(bufferPool.fetchPage(parentBlockIdx), PAGE_SIZE);
+        parentPage.setOverflowPtr(currIdx);
+        bufferPool.unpinPage(parentBlockIdx, true);
+
+        // Update current total size (only the new header, the parent's is already counted)
+        currentTotalSize += SlottedPage::HEADER_SIZE;
+
+        // Update number of overflow blocks and blocks
+        numBlocks++;
+        numOverflowBlocks++;
+
+        // Return index of current overflow block
+        return currIdx;
+        
+    }
+
+    // A record that doesn't even fit in an empty block would create overflow blocks forever
+    template <class RecordLike>
+    void checkRecordFits(const RecordLike &record) {
+        if (storedSize(record) > PAGE_SIZE - SlottedPage::HEADER_SIZE)
+            throw runtime_error("Record is too large to fit in a block");
+    }
+
+    // Modular function to write record to physical file
+    // Reducing redundancy
+    // NOTE: MEETS THREE BLOCKS REQUIREMENT, WE LOOK AT ONE BLOCK AT A TIME TO SEE IF
+    // WE CAN WRITE RECORD THERE, OTHERWISE WE CHECK OR CREATE OVERFLOW BLOCKS
+    // Returns the position in the chain of the block the record went to (0 is the base block)
+    template <class RecordLike>
+    int writeRecordToIndexFile(const RecordLike &record, int baseBlockPgIdx) {
+
+        checkRecordFits(record);
+
+        uint32_t tag = recordTag(record);
+        bool hasWrittenRecord = false;
+        int chainPosition = 0;
+
+        while (!hasWrittenRecord) {
+
+            // Only the header of the current block is needed, free space is known without
+            // parsing any of the records already in it
+            SlottedPage currPage(bufferPool.fetchPage(baseBlockPgIdx), PAGE_SIZE);
+
+            // Check if current record fits inside current block,
+            // if not then see if there is overflow and check overflow for space
+            // if there isn't, then create overflow and write record there
+            char *recordSpot = currPage.allocRecord(encodedSize(record), tag);
+
+            if (recordSpot != nullptr) {
+                
+                LHI_LOG(LOG_TRACE, "== New block size after record added: " << currPage.usedBytes());
+
+                // Record fits completely within block, slot was already added so write it at its spot
+                writeEncoded(record, recordSpot);
+                bufferPool.unpinPage(baseBlockPgIdx, true);
+
+                // Update current total size
+                currentTotalSize += recordSize(record);
+
+                // Set flag to true because we wrote record
+                hasWrittenRecord = true;
+
+            }
+            else if (currPage.overflowPtr() != -1) {
+                
+                // This means that current block is full, but there exists a linked overflow block
+                LHI_LOG(LOG_TRACE, "== Block full w/ overflow block, moving to existing overflow block w/ physical index " << currPage.overflowPtr());
+
+                // Set baseBlockPgIdx to overflow idx of the current block so that next loop iteration the currPage
+                // will be the overflow block and we can continue this iteration logic for writing record
+                int overflowIdx = currPage.overflowPtr();
+                bufferPool.unpinPage(baseBlockPgIdx, false);
+                baseBlockPgIdx = overflowIdx;
+                chainPosition++;
+
+            }
+            else {
+
+                // Create overflow since no overflow block exists
+                LHI_LOG(LOG_TRACE, "== Block full and no overflow block. Creating overflow block...");
+                bufferPool.unpinPage(baseBlockPgIdx, false);
+
+                // Initialize overflow block and return its physical offset index
+                int overflowIdx = initOverflowBlock(baseBlockPgIdx);
+
+                // Now move to overflow block and write record as its first slot
+                SlottedPage overflowPage(bufferPool.fetchPage(overflowIdx), PAGE_SIZE);
+                writeEncoded(record, overflowPage.allocRecord(encodedSize(record), tag));
+                bufferPool.unpinPage(overflowIdx, true);
+
+                // Update current total size
+                currentTotalSize += recordSize(record);
+
+                // Set flag
+                hasWrittenRecord = true;
+                chainPosition++;
+
+            }
+
+        }
+
+        return chainPosition;
+
+    }
+
+    // Write a record into the chain at baseBlockPgIdx (see writeRecordToIndexFile()) the way this index keeps
+    // records: in the page, or appended to the heap with only its directory entry going in the page
+    template <class RecordLike>
+    int writeStoredRecord(const RecordLike &record, int baseBlockPgIdx) {
+
+        if (!heap)
+            return writeRecordToIndexFile(record, baseBlockPgIdx);
+
+        vector<char> encoded(Serializer::encodedSize(record));
+        Serializer::write(record, encoded.data());
+
+        vector<char> entry;
+        makeDirectoryEntry(encoded.data(), encoded.size(), heap->append(encoded.data(), encoded.size()), entry);
+
+        return writeRecordToIndexFile(EncodedRecord{entry.data(), (int)entry.size()}, baseBlockPgIdx);
+
+    }
+
+    // Whether writing a record at chainPosition of its bucket's chain (see writeRecordToIndexFile()),
+    // adding an overflow block if createdOverflow, calls for a split under the index's SplitPolicy
+    bool shouldSplit(int chainPosition, bool createdOverflow) {
+
+        switch (SPLIT_POLICY) {
+        case SPLIT_ON_OVERFLOW:
+            return createdOverflow;
+        case SPLIT_ON_CHAIN_LENGTH:
+            return chainPosition >= MAX_CHAIN_LENGTH;
+        default:
+            return (double)currentTotalSize / numBuckets > SPLIT_THRESHOLD * PAGE_SIZE;
+        }
+
+    }
+
+    // Remove an empty overflow block from its chain (prevPgIdx -> pgIdx -> nextPgIdx) and free its page
+    void unlinkOverflowBlock(int prevPgIdx, int pgIdx, int nextPgIdx) {
+
+        SlottedPage prevPage(bufferPool.fetchPage(prevPgIdx), PAGE_SIZE);
+        prevPage.setOverflowPtr(nextPgIdx);
+        bufferPool.unpinPage(prevPgIdx, true);
+
+        freePage(pgIdx);
+        currentTotalSize -= SlottedPage::HEADER_SIZE;
+        numBlocks--;
+        numOverflowBlocks--;
+
+    }
+
+    // Take the record with id out of the chain starting at base block baseBlockPgIdx: the first one
+    // match(slot data, slot length) returns true for, which can pass over records in an index where
+    // keys aren't unique (see SecondaryEntrySerializer). With separate payloads match gets the directory entry
+    // An overflow block left empty is unlinked and freed right away
+    // Returns false if the chain has no such record
+    // Caller must hold the bucket's latch exclusively
+    template <class Match>
+    bool removeRecordFromChain(const Key &id, int baseBlockPgIdx, Match &&match) {
+
+        uint32_t tag = keyTag(id);
+        int prevPgIdx = -1;
+        int pgIdx = baseBlockPgIdx;
+
+        while (pgIdx != -1) {
+
+            SlottedPage currPage(bufferPool.fetchPage(pgIdx), PAGE_SIZE);
+            int nextPgIdx = currPage.overflowPtr();
+
+            for (int slot = currPage.findTag(tag); slot < currPage.numRecords(); slot = currPage.findTag(tag, slot + 1)) {
+
+                if (!Codec::matches(currPage.recordData(slot), id) || !match(currPage.recordData(slot), currPage.slotLength(slot)))
+                    continue;
+
+                currentTotalSize -= currPage.slotLength(slot) + SlottedPage::SLOT_SIZE;
+                numRecords--;
+
+                currPage.removeRecord(slot);
+                bool isEmptyOverflowBlock = currPage.numRecords() == 0 && prevPgIdx != -1;
+                bufferPool.unpinPage(pgIdx, true);
+
+                if (isEmptyOverflowBlock)
+                    unlinkOverflowBlock(prevPgIdx, pgIdx, nextPgIdx);
+
+                return true;
+
+            }
+
+            bufferPool.unpinPage(pgIdx, false);
+            prevPgIdx = pgIdx;
+            pgIdx = nextPgIdx;
+
+        }
+
+        return false;
+
+    }
+
+    // Write a full page image of moved records (built in splitBucket()) as the next block of the new
+    // bucket: the first batch goes into the bucket's empty base block, later ones into overflow blocks
+    // linked after tailPgIdx, which is updated to the block just written
+    void writeSplitBatch(int newBucketIdx, vector<char> &batch, int &tailPgIdx) {
+
+        // Headers of both kinds of block are already counted in currentTotalSize by initBucket()/initOverflowBlock()
+        int pgIdx = (tailPgIdx == -1) ? pageDirectory[newBucketIdx] : initOverflowBlock(tailPgIdx);
+
+        char *page = bufferPool.fetchPage(pgIdx);
+        memcpy(page, batch.data(), PAGE_SIZE);
+        bufferPool.unpinPage(pgIdx, true);
+
+        currentTotalSize += SlottedPage(batch.data(), PAGE_SIZE).usedBytes() - SlottedPage::HEADER_SIZE;
+        tailPgIdx = pgIdx;
+
+    }
+
+    // Split the next bucket in linear order: add bucket n and move the records of its buddy
+    // bucket (same index with the MSB cleared) whose hash now addresses the new bucket over to it
+    // Caller must be the writer (hold writerMutex)
+    void splitBucket() {
+
+        numSplits.fetch_add(1, memory_order_relaxed);
+        ScopedLatency splitTimer(timedBy(splitLatency));
+
+        // Now calculate the number of binary digits needed to address the new bucket
+        // ex. For third bucket with index 2, we need 2 binary digits to address 3 buckets
+        int digitsToAddrNewBucket = (int)ceil(log2(numBuckets + 1));
+
+        /* Rehash some search keys into this new bucket
+         * calculate the index of the real bucket that was used to hold
+         * records when the new bucket was still a ghost bucket
+         * ex. When adding third bucket, before third bucket with index 2 (binary: 10)
+         * was added, keys that were hashed to index 2 (binary: 10) had their MSB
+         * set to 0 to get a real bucket whose index was < than # of buckets, which
+         * in this case was bucket 0. So we rehash everything in bucket 0 to see if they need
+         * to be moved to the new bucket which now exists and is no longer a ghost bucket
+         */
+        int realBucketToMoveRecordsFromIdx = numBuckets;
+        realBucketToMoveRecordsFromIdx &= ~(1 << (digitsToAddrNewBucket - 1));
+
+        // Keep readers of the old bucket out until its records are sorted out
+        BucketLatch &oldBucketLatch = pageDirectory.latch(realBucketToMoveRecordsFromIdx);
+        oldBucketLatch.lock();
+
+        // Add a new bucket and publish the new (n, i) right away, the new bucket stays latched
+        // so readers that now hash to it wait for the records to get there
+        // Note: numBuckets is incremented at this point
+        beginDirectoryChange();
+        int newBucketIdx = initBucket();
+        BucketLatch &newBucketLatch = pageDirectory.latch(newBucketIdx);
+        newBucketLatch.lock();
+        i = digitsToAddrNewBucket;
+        endDirectoryChange();
+
+        // Debug prints
+        LHI_LOG(LOG_DEBUG, "** Number of buckets: " << numBuckets);
+        LHI_LOG(LOG_DEBUG, "** New bucket index (numBuckets - 1): " << newBucketIdx);
+        LHI_LOG(LOG_DEBUG, "** New bucket index binary (numBuckets - 1): " << bitset<32>(newBucketIdx));
+        LHI_LOG(LOG_DEBUG, "** Real bucket index to rehash to new bucket (binary): " << bitset<32>(realBucketToMoveRecordsFromIdx));
+
+        // Ghost bucket is now a real new bucket, move ghost search keys to this new real bucket
+        // Records that stay in the old bucket are never rewritten to another block: each block of the old
+        // chain is compacted in place (stayers slide together, movers are taken out). Movers are packed into
+        // a page sized buffer that is written out as the next block of the new bucket whenever it fills up,
+        // so a split reads the old chain once and only writes the blocks that actually changed
+        // Only keys are hashed to decide where a record goes, records are copied as raw bytes
+        vector<char> compactBuffer(PAGE_SIZE);
+        vector<char> moveBuffer(PAGE_SIZE);
+        SlottedPage movePage(moveBuffer.data(), PAGE_SIZE);
+        movePage.init();
+
+        // Last block of the new bucket written so far (-1 until its base block gets the first batch)
+        int newBucketTailPgIdx = -1;
+
+        // Previous block of the old chain that is kept, so empty overflow blocks can be unlinked
+        int prevPgIdx = -1;
+        int pgIdx = pageDirectory[realBucketToMoveRecordsFromIdx];
+
+        while (pgIdx != -1) {
+
+            SlottedPage oldPage(bufferPool.fetchPage(pgIdx), PAGE_SIZE);
+            int nextPgIdx = oldPage.overflowPtr();
+
+            SlottedPage stayPage(compactBuffer.data(), PAGE_SIZE);
+            stayPage.init();
+            stayPage.setOverflowPtr(nextPgIdx);
+            int numMoved = 0;
+
+            for (int slot = 0; slot < oldPage.numRecords(); slot++) {
+
+                const char *recordData = oldPage.recordData(slot);
+                int recordLength = oldPage.slotLength(slot);
+
+                // Consider last digitsToAddrNewBucket number of bits for each record
+                // If it matches the index of the new bucket then it moves, otherwise it stays
+                // Ex. For third new bucket at index 2 (binary: 10), we look at index 0 bucket for rehash and moving
+                // ghost keys; we now need to consider last 2 binary digits for each hashed id to see if it stays in current old
+                // bucket (last binary digits are 00) or gets moved to new bucket at index 2 (last binary digits are 10).
+                uint32_t tag = oldPage.slotTag(slot);
+
+                if (getLastIthBits(hashStored(recordData), digitsToAddrNewBucket) != newBucketIdx) {
+                    memcpy(stayPage.allocRecord(recordLength, tag), recordData, recordLength);
+                    continue;
+                }
+
+                char *recordSpot = movePage.allocRecord(recordLength, tag);
+                if (recordSpot == nullptr) {
+                    writeSplitBatch(newBucketIdx, moveBuffer, newBucketTailPgIdx);
+                    movePage.init();
+                    recordSpot = movePage.allocRecord(recordLength, tag);
+                }
+
+                memcpy(recordSpot, recordData, recordLength);
+                numMoved++;
+
+            }
+
+            LHI_LOG(LOG_TRACE, "Block at physical index " << pgIdx << ": " << numMoved << " of " << oldPage.numRecords() << " records moved");
+
+            // Nothing moved out of this block, it stays as is
+            if (numMoved == 0) {
+                bufferPool.unpinPage(pgIdx, false);
+                prevPgIdx = pgIdx;
+                pgIdx = nextPgIdx;
+                continue;
+            }
+
+            currentTotalSize += stayPage.usedBytes() - oldPage.usedBytes();
+
+            if (stayPage.numRecords() == 0 && prevPgIdx != -1) {
+
+                // Overflow block was emptied, unlink it from the chain and free it
+                // (the base block always stays since the page directory points at it)
+                bufferPool.unpinPage(pgIdx, false);
+                unlinkOverflowBlock(prevPgIdx, pgIdx, nextPgIdx);
+
+            }
+            else {
+
+                memcpy(oldPage.data, compactBuffer.data(), PAGE_SIZE);
+                bufferPool.unpinPage(pgIdx, true);
+                prevPgIdx = pgIdx;
+
+            }
+
+            pgIdx = nextPgIdx;
+
+        }
+
+        // Write whatever movers are left over
+        if (movePage.numRecords() > 0)
+            writeSplitBatch(newBucketIdx, moveBuffer, newBucketTailPgIdx);
+
+        newBucketLatch.unlock();
+        oldBucketLatch.unlock();
+
+    }
+
+    // Undo the last split: append every record of the last bucket to the chain of its buddy (same index
+    // with the MSB cleared), free the last bucket's blocks and drop it from the directory
+    // Both buckets stay latched until the records are over and the new (n, i) is published, the same
+    // way splitBucket() does it
+    // Caller must be the writer (hold writerMutex)
+    void mergeBucket() {
+
+        numMerges.fetch_add(1, memory_order_relaxed);
+
+        int lastBucketIdx = numBuckets - 1;
+        int buddyBucketIdx = lastBucketIdx & ~(1 << (i - 1));
+
+        BucketLatch &buddyBucketLatch = pageDirectory.latch(buddyBucketIdx);
+        buddyBucketLatch.lock();
+        BucketLatch &lastBucketLatch = pageDirectory.latch(lastBucketIdx);
+        lastBucketLatch.lock();
+
+        LHI_LOG(LOG_DEBUG, "** Merging bucket " << lastBucketIdx << " back into bucket " << buddyBucketIdx);
+
+        // Records go after whatever is already in the buddy's last block
+        int tailPgIdx = pageDirectory[buddyBucketIdx];
+        while (true) {
+            SlottedPage tailPage(bufferPool.fetchPage(tailPgIdx), PAGE_SIZE);
+            int nextPgIdx = tailPage.overflowPtr();
+            bufferPool.unpinPage(tailPgIdx, false);
+            if (nextPgIdx == -1)
+                break;
+            tailPgIdx = nextPgIdx;
+        }
+
+        int pgIdx = pageDirectory[lastBucketIdx];
+        bool isBaseBlock = true;
+
+        while (pgIdx != -1) {
+
+            SlottedPage lastPage(bufferPool.fetchPage(pgIdx), PAGE_SIZE);
+            SlottedPage tailPage(bufferPool.fetchPage(tailPgIdx), PAGE_SIZE);
+
+            for (int slot = 0; slot < lastPage.numRecords(); slot++) {
+
+                int recordLength = lastPage.slotLength(slot);
+                uint32_t tag = lastPage.slotTag(slot);
+                char *recordSpot = tailPage.allocRecord(recordLength, tag);
+
+                // Buddy's last block is full, continue in a new overflow block
+                if (recordSpot == nullptr) {
+                    bufferPool.unpinPage(tailPgIdx, true);
+                    tailPgIdx = initOverflowBlock(tailPgIdx);
+                    tailPage = SlottedPage(bufferPool.fetchPage(tailPgIdx), PAGE_SIZE);
+                    recordSpot = tailPage.allocRecord(recordLength, tag);
+                }
+
+                memcpy(recordSpot, lastPage.recordData(slot), recordLength);
+                currentTotalSize += recordLength + SlottedPage::SLOT_SIZE;
+
+            }
+
+            bufferPool.unpinPage(tailPgIdx, true);
+
+            // Everything in the block is now counted in the buddy
+            int nextPgIdx = lastPage.overflowPtr();
+            currentTotalSize -= lastPage.usedBytes();
+            bufferPool.unpinPage(pgIdx, false);
+
+            freePage(pgIdx);
+            numBlocks--;
+            if (!isBaseBlock)
+                numOverflowBlocks--;
+
+            isBaseBlock = false;
+            pgIdx = nextPgIdx;
+
+        }
+
+        beginDirectoryChange();
+        pageDirectory.pop_back();
+        numBuckets--;
+        i = (int)ceil(log2(numBuckets.load()));
+        endDirectoryChange();
+
+        lastBucketLatch.unlock();
+        buddyBucketLatch.unlock();
+
+    }
+
+    // Merge buckets while the average bucket is under the merge threshold, but only as long as
+    // the merged index wouldn't be over the split threshold (and split right back on the next insert)
+    // Caller must be the writer (hold writerMutex)
+    void mergeUnderusedBuckets() {
+
+        unique_lock<shared_mutex> structureLock(structureMutex, try_to_lock);
+        if (!structureLock.owns_lock())
+            return;
+
+        while (numBuckets > 2 &&
+               (double)currentTotalSize / numBuckets < MERGE_THRESHOLD * PAGE_SIZE &&
+               (double)currentTotalSize / (numBuckets - 1) <= SPLIT_THRESHOLD * PAGE_SIZE)
+            mergeBucket();
+
+    }
+
+    // Match for removeRecordFromChain() that takes the first record with the id, keeping its secondary key
+    // in removedKey so the record's secondary index entry can be found (left empty without a secondary index)
+    auto noteSecondaryKey(optional<SecondaryKey> &removedKey) {
+        return [this, &removedKey](const char *slotData, int recordLength) {
+            if constexpr (HasSecondaryKey<Serializer>) {
+                if (secondary) {
+                    vector<char> buffer;
+                    const char *recordData = resolveRecord(slotData, recordLength, buffer);
+                    removedKey = Serializer::secondaryKey(Serializer::view(recordData, recordLength));
+                }
+            }
+            return true;
+        };
+    }
+
+    // Keep the secondary index in step with a record added to this index
+    template <class RecordLike>
+    void addSecondaryEntry(const RecordLike &record) {
+        if constexpr (HasSecondaryKey<Serializer>) {
+            if (secondary)
+                secondary->insertRecord(SecondaryEntry<SecondaryKey, Key>{Serializer::secondaryKey(record), Serializer::key(record)});
+        }
+    }
+
+    // and with a record (with primary key id) removed from it
+    void removeSecondaryEntry(const SecondaryKey &secondaryKey, const Key &id) {
+        if constexpr (HasSecondaryKey<Serializer>) {
+
+            if (!secondary)
+                return;
+
+            lock_guard<mutex> secondaryWriterLock(secondary->writerMutex);
+            secondary->removeRecord(secondaryKey, [&id](const char *entryData, int entryLength) {
+                return SecondaryEntrySerializer<SecondaryKey, Key>::read(entryData, entryLength).primaryKey == id;
+            });
+
+        }
+    }
+
+    // and with a record that was updated, whose secondary key was oldSecondaryKey
+    template <class RecordLike>
+    void updateSecondaryEntry(const SecondaryKey &oldSecondaryKey, const RecordLike &record) {
+        if constexpr (HasSecondaryKey<Serializer>) {
+            if (secondary && oldSecondaryKey != Serializer::secondaryKey(record)) {
+                removeSecondaryEntry(oldSecondaryKey, Serializer::key(record));
+                addSecondaryEntry(record);
+            }
+        }
+    }
+
+    // Build the secondary index from scratch out of every record in this index
+    // (after a bulk build, or when the secondary index file is missing or out of step)
+    // Caller must be the writer (hold writerMutex)
+    void rebuildSecondaryIndex() {
+        if constexpr (HasSecondaryKey<Serializer>) {
+
+            if (!secondary)
+                return;
+
+            vector<SecondaryEntry<SecondaryKey, Key>> entries;
+            entries.reserve(numRecords);
+            vector<char> buffer;
+
+            for (int bucketIdx = 0; bucketIdx < numBuckets; bucketIdx++) {
+                for (int pgIdx = pageDirectory[bucketIdx]; pgIdx != -1; ) {
+
+                    SlottedPage page(bufferPool.fetchPage(pgIdx), PAGE_SIZE);
+                    for (int slot = 0; slot < page.numRecords(); slot++) {
+                        int recordLength = page.slotLength(slot);
+                        const char *recordData = resolveRecord(page.recordData(slot), recordLength, buffer);
+                        View record = Serializer::view(recordData, recordLength);
+                        entries.push_back({Serializer::secondaryKey(record), Serializer::key(record)});
+                    }
+
+                    int nextPgIdx = page.overflowPtr();
+                    bufferPool.unpinPage(pgIdx, false);
+                    pgIdx = nextPgIdx;
+
+                }
+            }
+
+            secondary->bulkLoadRecords(entries);
+
+        }
+    }
+
+    // Do the splits writes asked for (see structureMutex), unless a scan is running
+    // Every write during a scan may have asked for one, so past the first split they are only done while the
+    // index still needs them: the average bucket is over the split threshold (over the merge threshold for
+    // the policies that split on chain growth), the rest are dropped
+    // Caller must be the writer (hold writerMutex)
+    void runPendingSplits() {
+
+        if (pendingSplits == 0)
+            return;
+
+        unique_lock<shared_mutex> structureLock(structureMutex, try_to_lock);
+        if (!structureLock.owns_lock())
+            return;
+
+        double fillLimit = (SPLIT_POLICY == SPLIT_ON_UTILIZATION ? SPLIT_THRESHOLD : MERGE_THRESHOLD) * PAGE_SIZE;
+
+        splitBucket();
+        for (pendingSplits--; pendingSplits > 0 && (double)currentTotalSize / numBuckets > fillLimit; pendingSplits--)
+            splitBucket();
+        pendingSplits = 0;
+
+    }
+
+    // Body of flush() for callers that already are the writer
+    // With a write-ahead log this is a checkpoint: once the index file is synced nothing in the log is needed
+    void persist() {
+
+        if (!indexFile->isOpen())
+            return;
+
+        // Records are in the heap file before any entry pointing at them is in the index file
+        if (heap) {
+            if (wal)
+                heap->sync();
+            else
+                heap->flush();
+        }
+
+        writeMetadata();
+        bufferPool.flushAll();
+
+        if (wal) {
+            indexFile->sync();
+            wal->truncate();
+        }
+
+        if constexpr (HasSecondaryKey<Serializer>) {
+            if (secondary)
+                secondary->flush();
+        }
+
+    }
+
+    // Start an empty index file (and empty log and secondary index) for a build
+    void createIndexFile() {
+
+        bufferPool.reset();
+        indexFile->open(fName, true);
+        if (wal)
+            wal->open(fName + ".wal", true);
+        if (heap)
+            heap->open(fName + ".heap", true);
+        bufferPool.attach(*indexFile);
+        resetState();
+
+        if constexpr (HasSecondaryKey<Serializer>) {
+            if (secondary) {
+                lock_guard<mutex> secondaryWriterLock(secondary->writerMutex);
+                secondary->createIndexFile();
+            }
+        }
+
+    }
+
+    // Bracket one insert/delete/update for the write-ahead log, so all of its page changes (including the
+    // header and the directory pages it touched) are committed as one log record
+    // beginOperation() returns the directory size to hand to commitOperation()
+    int beginOperation() {
+
+        if (wal)
+            wal->beginOperation();
+
+        return pageDirectory.size();
+
+    }
+
+    void commitOperation(int directorySizeAtBegin) {
+
+        if (!wal)
+            return;
+
+        // Operations only add or drop buckets at the end of the directory
+        writeMetadata(min(directorySizeAtBegin, pageDirectory.size()));
+
+        // Records the operation appended have to be in the heap file once the log says it happened:
+        // handed to the OS here, synced by the log right before it syncs the commit (see constructor)
+        if (heap)
+            heap->flush();
+
+        wal->commitOperation();
+
+        if (wal->size() > walCheckpointBytes)
+            persist();
+
+    }
+
+    // Append record to a bulk load partition as its 4 byte length followed by the encoded record
+    template <class RecordLike>
+    void appendToPartition(vector<char> &partition, const RecordLike &record) {
+
+        int recordLength = encodedSize(record);
+        size_t oldSize = partition.size();
+
+        partition.resize(oldSize + sizeof(int) + recordLength);
+        memcpy(&partition[oldSize], &recordLength, sizeof(recordLength));
+        writeEncoded(record, &partition[oldSize + sizeof(int)]);
+
+    }
+
+    // Counters a bulk build adds up while laying out buckets (one per worker thread)
+    struct BuildCounters {
+        int numRecords = 0;
+        int numBlocks = 0;
+        int numOverflowBlocks = 0;
+        int64_t totalSize = 0;
+    };
+
+    // Pointers to the records of a bulk load partition (built by appendToPartition())
+    static vector<const char *> partitionRecords(const vector<char> &partition) {
+
+        vector<const char *> records;
+        size_t offset = 0;
+
+        while (offset < partition.size()) {
+            int recordLength;
+            memcpy(&recordLength, &partition[offset], sizeof(recordLength));
+            records.push_back(&partition[offset]);
+            offset += sizeof(int) + recordLength;
+        }
+
+        return records;
+
+    }
+
+    // Append the records of one bulk build bucket (each pointing at a length prefixed record) to the heap as one
+    // piece, so a bucket's records lie together in the heap, and put their directory entries, length prefixed the
+    // same way, in entryArena. Returns pointers to the entries
+    vector<const char *> appendBucketToHeap(const vector<const char *> &records, vector<char> &entryArena) {
+
+        vector<char> payloads;
+        for (const char *record : records) {
+            int recordLength;
+            memcpy(&recordLength, record, sizeof(recordLength));
+            payloads.insert(payloads.end(), record + sizeof(int), record + sizeof(int) + recordLength);
+        }
+
+        uint64_t offset = heap->append(payloads.data(), payloads.size());
+
+        entryArena.clear();
+        vector<char> entry;
+        for (const char *record : records) {
+            int recordLength;
+            memcpy(&recordLength, record, sizeof(recordLength));
+            makeDirectoryEntry(record + sizeof(int), recordLength, offset, entry);
+            appendToPartition(entryArena, EncodedRecord{entry.data(), (int)entry.size()});
+            offset += recordLength;
+        }
+
+        return partitionRecords(entryArena);
+
+    }
+
+    // Lay out all records of one bucket (each pointing at a length prefixed record) into a fresh chain
+    // of blocks (of their directory entries with separate payloads). The chain is packed in chainBuffer first
+    // so its pages can be allocated as one contiguous run and written sequentially, straight to the index file
+    // since none of them can be in the buffer pool yet. Safe to call from several threads at once as long as
+    // they work on different buckets.
+    void writeBulkBucket(int bucketIdx, const vector<const char *> &bucketRecords, vector<char> &chainBuffer, BuildCounters &counters) {
+
+        vector<char> entryArena;
+        vector<const char *> entries;
+        if (heap)
+            entries = appendBucketToHeap(bucketRecords, entryArena);
+        const vector<const char *> &records = heap ? entries : bucketRecords;
+
+        int numPages = 1;
+        chainBuffer.assign(PAGE_SIZE, 0);
+        SlottedPage(chainBuffer.data(), PAGE_SIZE).init();
+
+        for (const char *record : records) {
+
+            int recordLength;
+            memcpy(&recordLength, record, sizeof(recordLength));
+
+            if (recordLength + SlottedPage::SLOT_SIZE > PAGE_SIZE - SlottedPage::HEADER_SIZE)
+                throw runtime_error("Record is too large to fit in a block");
+
+            uint32_t tag = storedKeyTag(record + sizeof(int));
+            char *recordSpot = SlottedPage(&chainBuffer[(numPages - 1) * PAGE_SIZE], PAGE_SIZE).allocRecord(recordLength, tag);
+
+            // Block is full, start an overflow block after it
+            if (recordSpot == nullptr) {
+
+                numPages++;
+                chainBuffer.resize(numPages * PAGE_SIZE, 0);
+
+                SlottedPage overflowPage(&chainBuffer[(numPages - 1) * PAGE_SIZE], PAGE_SIZE);
+                overflowPage.init();
+                recordSpot = overflowPage.allocRecord(recordLength, tag);
+
+            }
+
+            memcpy(recordSpot, record + sizeof(int), recordLength);
+            counters.numRecords++;
+
+        }
+
+        // Chain is complete, give it pages and link each block to the next one
+        int firstPgIdx = allocatePages(numPages);
+
+        for (int p = 0; p < numPages; p++) {
+
+            SlottedPage page(&chainBuffer[p * PAGE_SIZE], PAGE_SIZE);
+            if (p + 1 < numPages)
+                page.setOverflowPtr(firstPgIdx + p + 1);
+
+            counters.totalSize += page.usedBytes();
+            indexFile->writePage(firstPgIdx + p, page.data);
+
+        }
+
+        pageDirectory.set(bucketIdx, firstPgIdx);
+        counters.numBlocks += numPages;
+        counters.numOverflowBlocks += numPages - 1;
+
+    }
+
+    // Fold counters of a bulk build back into the index
+    void addBuildCounters(const BuildCounters &counters) {
+        numRecords += counters.numRecords;
+        numBlocks += counters.numBlocks;
+        numOverflowBlocks += counters.numOverflowBlocks;
+        currentTotalSize += counters.totalSize;
+    }
+
+    // Final split state of a bulk build of records adding up to totalRecordBytes (see recordSize()):
+    // the smallest n that keeps the average bucket under the split threshold
+    void presizeBuckets(long long totalRecordBytes) {
+        numBuckets = max(2LL, (long long)ceil(totalRecordBytes / (SPLIT_THRESHOLD * PAGE_SIZE - SlottedPage::HEADER_SIZE)));
+        i = (int)ceil(log2(numBuckets.load()));
+        pageDirectory.assign(numBuckets, -1);
+    }
+
+    // The bucket count of presizeBuckets() ignores the headers of overflow blocks, so there may be a split
+    // or two left that the incremental path would have done
+    void finishBulkSplits() {
+        while ((double)currentTotalSize / numBuckets > SPLIT_THRESHOLD * PAGE_SIZE)
+            splitBucket();
+    }
+
+    // Records parsed by one thread of the parallel build: length prefixed encoded records
+    // (see appendToPartition()) back to back, where each one starts and its id
+    struct ParsedChunk {
+        vector<char> arena;
+        vector<size_t> offsets;
+        vector<Key> ids;
+        long long recordBytes = 0;
+    };
+
+    // Parse every csv row that starts in [startOffset, endOffset) of the file (see storedForm())
+    // recordBytes counts what the records will add to blocks (see storedSize())
+    void parseCsvChunk(const string &csvFName, long long startOffset, long long endOffset, ParsedChunk &chunk) {
+
+        CsvReader reader(csvFName, startOffset, endOffset);
+        vector<string_view> fields;
+        vector<char> buffer;
+
+        while (reader.nextRow(fields)) {
+
+            View record = storedForm(Serializer::parseCsvRow(fields), compressRecords, buffer);
+
+            chunk.offsets.push_back(chunk.arena.size());
+            chunk.ids.push_back(Serializer::key(record));
+            chunk.recordBytes += storedSize(record);
+
+            int recordLength = Serializer::encodedSize(record);
+            size_t oldSize = chunk.arena.size();
+            chunk.arena.resize(oldSize + sizeof(int) + recordLength);
+            memcpy(&chunk.arena[oldSize], &recordLength, sizeof(recordLength));
+            Serializer::write(record, &chunk.arena[oldSize + sizeof(int)]);
+
+        }
+
+    }
+
+    // Run fn(0) ... fn(numThreads - 1) on their own threads and wait for all of them,
+    // rethrowing the first exception any of them hit
+    static void runOnThreads(int numThreads, const function<void(int)> &fn) {
+
+        vector<thread> threads;
+        vector<exception_ptr> errors(numThreads);
+
+        for (int t = 0; t < numThreads; t++) {
+            threads.emplace_back([&fn, &errors, t]() {
+                try {
+                    fn(t);
+                }
+                catch (...) {
+                    errors[t] = current_exception();
+                }
+            });
+        }
+
+        for (thread &worker : threads)
+            worker.join();
+
+        for (exception_ptr &error : errors) {
+            if (error)
+                rethrow_exception(error);
+        }
+
+    }
+
+    // Probe the bucket chain of id and call onMatch(record data, record length) with the encoded record if
+    // it is found. Each block's tag column is searched for the key's tag a vector at a time (see TagMatcher),
+    // and only the stored keys of the slots it turns up are compared, nothing is copied out of the page
+    // (the data is only valid inside onMatch)
+    // Returns false if no record has the id
+    template <class Callback>
+    bool probeEncoded(const Key &id, Callback &&onMatch) {
+
+        ScopedLatency lookupTimer(timedBy(lookupLatency));
+
+        if (numBuckets == 0)
+            return false;
+
+        // Calculate bucket index (real or ghost bucket) from the last i'th bits
+        // and latch it so a concurrent insert or split can't change the chain under us
+        int bucketIdx = latchBucketForRead(id);
+        BucketLatch &latch = pageDirectory.latch(bucketIdx);
+        uint32_t tag = keyTag(id);
+
+        // Iterate through block by block of the bucket (base + overflow blocks)
+        // until record with id is found
+
+        // Get page index
+        int pgIdx = pageDirectory[bucketIdx];
+
+        while (pgIdx != -1) {
+            
+            // Pin block
+            // NOTE: MEETS 3 BLOCKS IN MAIN MEMORY REQUIREMENT
+            // WE LOOK AT ONE BLOCK AT A TIME AND THEN MOVE TO NEXT BLOCK
+            SlottedPage currPage(bufferPool.fetchPage(pgIdx), PAGE_SIZE);
+
+            // Check if record with target ID in block
+            for (int slot = currPage.findTag(tag); slot < currPage.numRecords(); slot = currPage.findTag(tag, slot + 1)) {
+
+                const char *recordData = currPage.recordData(slot);
+                int recordLength = currPage.slotLength(slot);
+
+                if (!Codec::matches(recordData, id))
+                    continue;
+
+                if (!heap) {
+                    onMatch(recordData, recordLength);
+                    bufferPool.unpinPage(pgIdx, false);
+                    latch.unlockShared();
+                    return true;
+                }
+
+                // The record is read from the heap once the page and the bucket are let go (records in the
+                // heap never change, so it can't go stale in between)
+                HeapPointer pointer = heapPointerOf(recordData, recordLength);
+                bufferPool.unpinPage(pgIdx, false);
+                latch.unlockShared();
+
+                vector<char> buffer(pointer.length);
+                heap->read(pointer.offset, pointer.length, buffer.data());
+                onMatch(buffer.data(), pointer.length);
+                return true;
+
+            }
+
+            // Move up pgIdx to overflow block for next iteration
+            int nextPgIdx = currPage.overflowPtr();
+            bufferPool.unpinPage(pgIdx, false);
+            pgIdx = nextPgIdx;
+
+        }
+
+        latch.unlockShared();
+        return false;
+
+    }
+
+    // Call onMatch(record data, record length) for every record with the id in its bucket chain, for an
+    // index where keys aren't unique (the secondary index). The data is only valid inside onMatch
+    template <class Callback>
+    void probeAllEncoded(const Key &id, Callback &&onMatch) {
+
+        if (numBuckets == 0)
+            return;
+
+        int bucketIdx = latchBucketForRead(id);
+        uint32_t tag = keyTag(id);
+        vector<char> buffer;
+
+        for (int pgIdx = pageDirectory[bucketIdx]; pgIdx != -1; ) {
+
+            SlottedPage currPage(bufferPool.fetchPage(pgIdx), PAGE_SIZE);
+
+            for (int slot = currPage.findTag(tag); slot < currPage.numRecords(); slot = currPage.findTag(tag, slot + 1)) {
+                if (!Codec::matches(currPage.recordData(slot), id))
+                    continue;
+                int recordLength = currPage.slotLength(slot);
+                const char *recordData = resolveRecord(currPage.recordData(slot), recordLength, buffer);
+                onMatch(recordData, recordLength);
+            }
+
+            int nextPgIdx = currPage.overflowPtr();
+            bufferPool.unpinPage(pgIdx, false);
+            pgIdx = nextPgIdx;
+
+        }
+
+        pageDirectory.latch(bucketIdx).unlockShared();
+
+    }
+
+    // Buckets a scan reads ahead and walks as one batch
+    static constexpr int SCAN_BATCH_BUCKETS = 64;
+
+    // Call onRecord(record data, record length) for every record in buckets [firstBucket, endBucket) whose
+    // view predicate accepts (the data is only valid inside onRecord, which must not write to the index). Chains are walked in physical
+    // order of their base blocks, and the runs of base blocks are prefetched before the first one is read,
+    // so a bulk built index (whose chains lie in bucket order) is read front to back
+    // Caller must hold structureMutex shared
+    template <class Predicate, class Callback>
+    void scanBuckets(int firstBucket, int endBucket, Predicate &predicate, Callback &onRecord) {
+
+        // (physical page of base block, bucket index)
+        vector<pair<int, int>> chains;
+        for (int bucketIdx = firstBucket; bucketIdx < endBucket; bucketIdx++)
+            chains.push_back({pageDirectory[bucketIdx], bucketIdx});
+        sort(chains.begin(), chains.end());
+
+        for (size_t runStart = 0; runStart < chains.size(); ) {
+            size_t runEnd = runStart + 1;
+            while (runEnd < chains.size() && chains[runEnd].first == chains[runEnd - 1].first + 1)
+                runEnd++;
+            indexFile->prefetch(chains[runStart].first, runEnd - runStart);
+            runStart = runEnd;
+        }
+
+        vector<char> buffer;
+
+        for (const pair<int, int> &chain : chains) {
+
+            BucketLatch &latch = pageDirectory.latch(chain.second);
+            latch.lockShared();
+
+            for (int pgIdx = chain.first; pgIdx != -1; ) {
+
+                SlottedPage currPage(bufferPool.fetchPage(pgIdx), PAGE_SIZE);
+
+                for (int slot = 0; slot < currPage.numRecords(); slot++) {
+                    int recordLength = currPage.slotLength(slot);
+                    const char *recordData = resolveRecord(currPage.recordData(slot), recordLength, buffer);
+                    if (predicate(Serializer::view(recordData, recordLength)))
+                        onRecord(recordData, recordLength);
+                }
+
+                int nextPgIdx = currPage.overflowPtr();
+                bufferPool.unpinPage(pgIdx, false);
+                pgIdx = nextPgIdx;
+
+            }
+
+            latch.unlockShared();
+
+        }
+
+    }
+
+    // Copy the records the directory entries point at to a new heap file, bucket by bucket, which leaves out the
+    // records deleted or replaced since they were appended, and point the entries at the copies. The entries
+    // are written back before the new heap file takes the old one's name, a crash in between leaves entries
+    // pointing into the wrong file, so like compact() this is meant to be run offline
+    // Caller must be the writer (hold writerMutex)
+    void compactHeap() {
+
+        string heapFName = fName + ".heap";
+        HeapFile compacted;
+        if (!compacted.open(heapFName + ".compact", true))
+            throw runtime_error("Could not create " + heapFName + ".compact");
+
+        uint64_t oldBytes = heap->size();
+        vector<char> buffer;
+
+        for (int bucketIdx = 0; bucketIdx < numBuckets; bucketIdx++) {
+            for (int pgIdx = pageDirectory[bucketIdx]; pgIdx != -1; ) {
+
+                SlottedPage page(bufferPool.fetchPage(pgIdx), PAGE_SIZE);
+
+                for (int slot = 0; slot < page.numRecords(); slot++) {
+                    int recordLength = page.slotLength(slot);
+                    const char *recordData = resolveRecord(page.recordData(slot), recordLength, buffer);
+                    uint64_t offset = compacted.append(recordData, recordLength);
+                    char *pointerData = page.data + page.slotOffset(slot) + page.slotLength(slot) - HEAP_POINTER_SIZE;
+                    memcpy(pointerData, &offset, sizeof(offset));
+                }
+
+                int nextPgIdx = page.overflowPtr();
+                bufferPool.unpinPage(pgIdx, page.numRecords() > 0);
+                pgIdx = nextPgIdx;
+
+            }
+        }
+
+        compacted.sync();
+        uint64_t newBytes = compacted.size();
+        compacted.close();
+
+        persist();
+        heap->close();
+        if (rename((heapFName + ".compact").c_str(), heapFName.c_str()) != 0 || !heap->open(heapFName, false))
+            throw runtime_error("Could not replace " + heapFName);
+
+        LHI_LOG(LOG_INFO, "Compacted heap " << heapFName << " from " << oldBytes << " to " << newBytes << " bytes");
+
+    }
+
+    // Body of deleteRecordById(): remove the first record with id that match accepts (see removeRecordFromChain())
+    // Caller must be the writer (hold writerMutex)
+    template <class Match>
+    bool removeRecord(const Key &id, Match &&match) {
+
+        if (numBuckets == 0)
+            return false;
+
+        int directorySize = beginOperation();
+        int bucketIdx = getBucketIdx(id);
+        BucketLatch &latch = pageDirectory.latch(bucketIdx);
+
+        latch.lock();
+        bool removed = removeRecordFromChain(id, pageDirectory[bucketIdx], match);
+        latch.unlock();
+
+        if (removed)
+            mergeUnderusedBuckets();
+
+        commitOperation(directorySize);
+
+        return removed;
+
+    }
+
+    // Build the index out of records already in memory in one go, laid out the way bulkLoadFromFile() does
+    // (how the secondary index is built)
+    void bulkLoadRecords(const vector<Rec> &records) {
+
+        lock_guard<mutex> writerLock(writerMutex);
+
+        createIndexFile();
+
+        long long totalRecordBytes = 0;
+        for (const Rec &record : records)
+            totalRecordBytes += storedSize(record);
+
+        if (!records.empty()) {
+
+            presizeBuckets(totalRecordBytes);
+
+            vector<vector<char>> buckets(numBuckets);
+            for (const Rec &record : records)
+                appendToPartition(buckets[getBucketIdx(Serializer::key(record))], record);
+
+            BuildCounters counters;
+            vector<char> chainBuffer;
+            for (int bucketIdx = 0; bucketIdx < numBuckets; bucketIdx++)
+                writeBulkBucket(bucketIdx, partitionRecords(buckets[bucketIdx]), chainBuffer, counters);
+            addBuildCounters(counters);
+
+            finishBulkSplits();
+
+        }
+
+        persist();
+
+    }
+
+    // Body of updateRecord()
+    template <class RecordLike>
+    bool updateRecordLike(const RecordLike &record) {
+
+        lock_guard<mutex> writerLock(writerMutex);
+        if (numBuckets == 0)
+            return false;
+
+        // Check before anything is removed so a failed update leaves the old record in place
+        checkRecordFits(record);
+
+        int directorySize = beginOperation();
+        Key id = Serializer::key(record);
+        int bucketIdx = getBucketIdx(id);
+        int pgIdx = pageDirectory[bucketIdx];
+        BucketLatch &latch = pageDirectory.latch(bucketIdx);
+
+        // Readers of the bucket wait until the new version is in
+        int oldNumOverflowBlocks = numOverflowBlocks;
+        int chainPosition = 0;
+        optional<SecondaryKey> oldSecondaryKey;
+        latch.lock();
+        bool found = removeRecordFromChain(id, pgIdx, noteSecondaryKey(oldSecondaryKey));
+        if (found) {
+            chainPosition = writeStoredRecord(record, pgIdx);
+            numRecords++;
+        }
+        latch.unlock();
+
+        if (found) {
+
+            // Bucket size changed by however much the record grew or shrunk
+            if (shouldSplit(chainPosition, numOverflowBlocks > oldNumOverflowBlocks))
+                pendingSplits++;
+            else
+                mergeUnderusedBuckets();
+            runPendingSplits();
+
+        }
+
+        commitOperation(directorySize);
+
+        if (oldSecondaryKey)
+            updateSecondaryEntry(*oldSecondaryKey, record);
+
+        return found;
+
+    }
+
+    // Body of both insertRecord() overloads
+    template <class RecordLike>
+    void insertRecordLike(const RecordLike &record) {
+
+        lock_guard<mutex> writerLock(writerMutex);
+        ScopedLatency insertTimer(timedBy(insertLatency));
+
+        // Fail before anything is changed
+        checkRecordFits(record);
+
+        // An index that was neither created nor opened starts out as a new empty index file
+        if (!indexFile->isOpen())
+            createIndexFile();
+
+        int directorySize = beginOperation();
+
+        // No buckets in index yet
+        if (numBuckets == 0) {
+
+            beginDirectoryChange();
+
+            // Initialize index with first blocks (start with 2)
+            // buckets
+            for (int i = 0; i < 2; i++) {
+                initBucket();
+            }
+
+            // 1 bit needed to address 2 buckets/blocks
+            i = 1;
+
+            endDirectoryChange();
+            
+        }
+
+        // Add record to the index in the correct block, creating overflow block if necessary
+        // hash to get index hash and then take last i'th bits to get bucket index
+        int bucketIdx = getLastIthBits(hash(Serializer::key(record)), i);
+
+        // Debug print last i'th bits
+        LHI_LOG(LOG_TRACE, "Bucket index: " << bucketIdx);
+        LHI_LOG(LOG_TRACE, "Last " << i << " bit(s): " << bitset<32>(bucketIdx));
+        
+
+        // If value of last i'th bits >= n, then set MSB from 1 to 0
+        // Deals with virtual/ghost buckets
+        if (bucketIdx >= numBuckets) {
+            LHI_LOG(LOG_TRACE, "Set bucket index MSB to 0, # of buckets is: " << numBuckets);
+            bucketIdx &= ~(1 << (i-1));
+        }
+        
+        // then insert in index file at the bucket index (pgdir[bucket_idx] gives actual offset idx for index file)
+        int pgIdx = pageDirectory[bucketIdx];
+        LHI_LOG(LOG_TRACE, "Physical offset index of bucket index " << bucketIdx << ": " << pgIdx);
+
+        // Write at that block spot in index file
+        // FIND EMPTY SPOT WITHIN BLOCK IF POSSIBLE OTHERWISE OVERFLOW
+
+        // We may or may not need to navigate through multiple blocks before writing record
+        // Especially if there are multiple overflow blocks
+        // Readers of this bucket wait on its latch until the record is in
+        BucketLatch &latch = pageDirectory.latch(bucketIdx);
+        int oldNumOverflowBlocks = numOverflowBlocks;
+        latch.lock();
+        int chainPosition = writeStoredRecord(record, pgIdx);
+        latch.unlock();
+
+        // Increment # of records
+        numRecords++;
+
+        // Take neccessary steps if capacity is reached
+        // By default: average bytes capacity per bucket (not block) is > 70% of a page
+        if (shouldSplit(chainPosition, numOverflowBlocks != oldNumOverflowBlocks))
+            pendingSplits++;
+        runPendingSplits();
+
+        commitOperation(directorySize);
+
+        addSecondaryEntry(record);
+
+    }
+
+public:
+    LinearHashIndex(string indexFileName, IndexOptions options = IndexOptions())
+        : PAGE_SIZE(options.pageSize), SPLIT_POLICY(options.splitPolicy), SPLIT_THRESHOLD(options.splitThreshold),
+          MERGE_THRESHOLD(options.mergeThreshold), MAX_CHAIN_LENGTH(options.maxChainLength),
+          bufferPool(options.numFrames, options.pageSize) {
+
+        // Pages have to hold the header page fields and a few records, offsets within a page are ints
+        if (PAGE_SIZE < 1024 || PAGE_SIZE > (1 << 20) || (PAGE_SIZE & (PAGE_SIZE - 1)) != 0)
+            throw runtime_error("Page size has to be a power of two from 1K to 1M");
+        if (!(MERGE_THRESHOLD >= 0 && MERGE_THRESHOLD < SPLIT_THRESHOLD && SPLIT_THRESHOLD <= 1))
+            throw runtime_error("Fill thresholds have to be 0 <= merge threshold < split threshold <= 1");
+        if (MAX_CHAIN_LENGTH < 1)
+            throw runtime_error("Max chain length has to be at least 1");
+
+        fName = indexFileName;
+        directoryVersion = 0;
+        resetState();
+
+        if (options.backend == MMAP_BACKEND)
+            indexFile.reset(new MmapPageFile(PAGE_SIZE));
+        else
+            indexFile.reset(new StreamPageFile(PAGE_SIZE));
+
+        trackLatencies = options.trackLatencies;
+        walCheckpointBytes = options.walCheckpointBytes;
+
+        compressRecords = options.compressRecords;
+        if (compressRecords && !HasCompression<Serializer>)
+            throw runtime_error("The serializer can't compress records");
+
+        if (options.separatePayloads)
+            heap.reset(new HeapFile());
+
+        if (options.writeAheadLog) {
+
+            if (options.backend == MMAP_BACKEND)
+                throw runtime_error("The write-ahead log needs the stream backend");
+
+            wal.reset(new WriteAheadLog(options.walSyncPolicy, options.walGroupCommitSize, options.walGroupCommitMicros, PAGE_SIZE));
+            wal->attach(*indexFile);
+            bufferPool.setWriteHook(wal.get());
+
+            // One heap fsync per group of commits instead of one per commit
+            if (heap)
+                wal->setBeforeSync([this] { heap->sync(); });
+
+        }
+
+        if (options.secondaryIndex) {
+
+            if constexpr (HasSecondaryKey<Serializer>) {
+                IndexOptions secondaryOptions = options;
+                secondaryOptions.secondaryIndex = false;
+                secondaryOptions.compressRecords = false;
+                secondaryOptions.separatePayloads = false;
+                secondary.reset(new SecondaryIndex(fName + ".secondary", secondaryOptions));
+            }
+            else
+                throw runtime_error("The serializer has no secondary key to index");
+
+        }
+
+    }
+
+    // Insert new record into index
+    // Safe to call while other threads are looking records up (only one inserting thread at a time)
+    // The first insert into an index that wasn't built or open()ed creates an empty index file for it
+    void insertRecord(const Rec &record) {
+
+        if constexpr (HasCompression<Serializer>) {
+            if (compressRecords) {
+                vector<char> buffer;
+                insertRecordLike(Serializer::compress(record, buffer));
+                return;
+            }
+        }
+
+        insertRecordLike(record);
+
+    }
+
+    // Insert a record straight from a view (e.g. one parsed by CsvReader), without building a Rec first
+    // (a serializer whose View is the record type itself only has the overload above)
+    void insertRecord(const View &record) requires (!is_same_v<View, Rec>) {
+        vector<char> buffer;
+        insertRecordLike(storedForm(record, compressRecords, buffer));
+    }
+
+    // Remove the record with id from the index, returns false if there is no such record
+    // Undoes splits once the index gets sparse enough (see mergeUnderusedBuckets())
+    // Safe to call while other threads are looking records up (only one writing thread at a time)
+    bool deleteRecordById(const Key &id) {
+
+        lock_guard<mutex> writerLock(writerMutex);
+
+        optional<SecondaryKey> removedSecondaryKey;
+        bool removed = removeRecord(id, noteSecondaryKey(removedSecondaryKey));
+
+        if (removedSecondaryKey)
+            removeSecondaryEntry(*removedSecondaryKey, id);
+
+        return removed;
+
     }
 
-    void print() {
-        cout << "\tID: " << id << "\n";
-        cout << "\tNAME: " << name << "\n";
-        cout << "\tBIO: " << bio << "\n";
-        cout << "\tMANAGER_ID: " << manager_id << "\n";
-    }
+    // Replace the record that has the same id as record, returns false (and changes nothing)
+    // if there is no such record. The record is written back into its bucket's chain, first
+    // block with room for it, so a record that grew may end up in a different block
+    bool updateRecord(Rec record) {
 
-    // Calculate size of record to determine if it can fit in block
-    int calcSize() {
+        if constexpr (HasCompression<Serializer>) {
+            if (compressRecords) {
+                vector<char> buffer;
+                return updateRecordLike(Serializer::compress(record, buffer));
+            }
+        }
 
-        // id and manager_id are both fixed 8 bytes
-        // bio and name size depend on length (variable size)
-        // We have 4 delimiters so 4 bytes extra as well
-        return 8 + 8 + bio.length() + name.length() + 4;
+        return updateRecordLike(record);
 
     }
 
-    // Takes output stream and writes all member variables (not member functions) to it.
-    // Assumes that stream is in binary mode
-    // writes delimiters as well (since ints are 4 bytes on hadoop server
-    // I chose to write size of int * 2 so that ints are 8 bytes)
-    void writeRecord(fstream &indexFile) {
+    // Errors can't be thrown out of here (that terminates the program while unwinding), so they are only
+    // logged. Call flush() before the index goes away to get them as exceptions
+    ~LinearHashIndex() {
+        try {
+            flush();
+        }
+        catch (const exception &e) {
+            LHI_LOG(LOG_ERROR, "Could not flush index " << fName << ": " << e.what());
+        }
+    }
 
-        int64_t paddedId = (int64_t)id;
-        int64_t paddedManagerId = (int64_t)manager_id;
+    // Open an existing index file written by an earlier createFromFile() so it can
+    // serve lookups right away without rebuilding it from the .csv file
+    // Returns false if there is no usable index file
+    bool open() {
+
+        bufferPool.reset();
+        if (!indexFile->open(fName, false))
+            return false;
+
+        // Pages of a file built with another page size can't even be read (or recovered) with this one
+        int filePageSize = storedPageSize();
+        if (filePageSize != -1 && filePageSize != PAGE_SIZE) {
+            LHI_LOG(LOG_WARN, "Index file " << fName << " has " << filePageSize << " byte pages, this index uses " << PAGE_SIZE);
+            indexFile->close();
+            return false;
+        }
 
-        // cout << "Size of padded ID: " << sizeof(paddedId) << " byte(s)" << endl;
-        // cout << "Size of padded manager ID: " << sizeof(paddedManagerId) << " byte(s)" << endl;
+        // Bring the index file up to the last operation committed to the log before reading any of it
+        if (wal) {
 
-        // Cast int members to int64_t to write 8 bytes to index file
-        indexFile.write(reinterpret_cast<const char *>(&paddedId), sizeof(paddedId));
-        indexFile << "~";
-        indexFile << name;
-        indexFile << "~";
-        indexFile << bio;
-        indexFile << "~";
-        indexFile.write(reinterpret_cast<const char *>(&paddedManagerId), sizeof(paddedManagerId));
-        indexFile << "~";
+            if (!wal->open(fName + ".wal", false))
+                return false;
 
-    }
+            int numReplayed = wal->recover(*indexFile);
+            if (numReplayed > 0)
+                LHI_LOG(LOG_INFO, "Recovered " << numReplayed << " operations from the write-ahead log");
 
-};
+        }
 
-// This class is mainly for parsing blocks, so it represents an entire
-// block in the index file programmatically, which makes it easy to keep track
-// of 3 blocks + page directory memory limit in main memory (logical block rather than physical
-// block).
-class Block {
-private:
-    const int PAGE_SIZE = 4096;
+        if (heap && !heap->open(fName + ".heap", false)) {
+            LHI_LOG(LOG_WARN, "Heap file " << fName << ".heap is missing, the index needs to be rebuilt");
+            indexFile->close();
+            return false;
+        }
 
-public:
-    // Logical records in the block
-    vector<Record> records;
+        bufferPool.attach(*indexFile);
 
-    // Keep track of block size for easy way to calculate average utilization of block
-    // to see if we need to increment n
-    int blockSize;
+        if (!readMetadata()) {
+            LHI_LOG(LOG_WARN, "Index file " << fName << " is not a valid index, it needs to be rebuilt");
+            bufferPool.reset();
+            indexFile->close();
+            resetState();
+            return false;
+        }
 
-    // Overflow pointer idx value
-    int overflowPtrIdx;
+        LHI_LOG(LOG_INFO, "Opened index " << fName << " (" << numRecords << " records in " << numBuckets << " buckets)");
 
-    // Number of records in the block
-    int numRecords;
+        // Secondary index is rebuilt if it is missing or out of step with the index (e.g. after a crash
+        // between writing the two)
+        if constexpr (HasSecondaryKey<Serializer>) {
+            if (secondary && !(secondary->open() && secondary->numRecords == numRecords)) {
+                LHI_LOG(LOG_INFO, "Rebuilding secondary index " << fName << ".secondary");
+                lock_guard<mutex> writerLock(writerMutex);
+                rebuildSecondaryIndex();
+            }
+        }
 
-    // Physical index of the block (offset index to block location in index file)
-    int blockIdx;
+        return true;
 
-    Block() {
-        blockSize = 0;
-        blockIdx = 0;
     }
 
-    Block(int physIdx) {
-        blockSize = 0;
-        blockIdx = physIdx;
+    // Persist header page and page directory, then write back all dirty pages
+    // Throws runtime_error if the index or log file can't be written or synced
+    void flush() {
+
+        lock_guard<mutex> writerLock(writerMutex);
+
+        if (pendingSplits > 0) {
+            int directorySize = beginOperation();
+            runPendingSplits();
+            commitOperation(directorySize);
+        }
+
+        persist();
+
     }
 
-    // Reads record from index file
-    // Assumes you are at correct position in block to start reading record
-    // and that the format matches what was written in writeRecord()
-    void readRecord(fstream &inputFile) {
-        
-        // Get 8 byte ints to temporarily store 8 byte ints in file
-        // before converting back to 4 byte ints used in the Record class
-        int64_t paddedId;
-        int64_t paddedManagerId;
-        string name, bio;
+    // Give trailing free pages back to the file system by truncating the index file after the
+    // last page still in use. Free pages in the middle of the file stay on the free list, which is
+    // rebuilt in ascending page order so later allocations fill the front of the file first.
+    // Meant to be run offline, with no lookups running against the index.
+    // Returns the number of pages the file shrank by
+    int compact() {
 
-        inputFile.read(reinterpret_cast<char *>(&paddedId), sizeof(paddedId));
-        // Ignore delimeter right after binary int
-        inputFile.ignore(1, '~');
-        getline(inputFile, name, '~');
-        getline(inputFile, bio, '~');
-        inputFile.read(reinterpret_cast<char *>(&paddedManagerId), sizeof(paddedManagerId));
-        // Ignore delimeter right after binary int
-        inputFile.ignore(1, '~');
+        lock_guard<mutex> writerLock(writerMutex);
 
-        cout << "READ IN: " << paddedId << " " << name << endl;
-        // cout << name << endl;
-        // cout << bio << endl;
-        // cout << paddedManagerId << endl;
+        if (!indexFile->isOpen())
+            return 0;
 
-        int regularId = (int)paddedId;
-        int regularManagerId = (int)paddedManagerId;
-        vector<string> fields{to_string(regularId), name, bio, to_string(regularManagerId)};
+        // Relinking the free list is logged like any other operation
+        int directorySize = beginOperation();
 
-        records.push_back(Record(fields));
+        // Directory pages are allocated up front so nothing is taken off the list below
+        writeMetadata();
 
-    }
+        vector<int> freePages;
+        for (int pgIdx = freeListHead; pgIdx != -1; ) {
+
+            freePages.push_back(pgIdx);
+
+            const char *page = bufferPool.fetchPage(pgIdx);
+            memcpy(&pgIdx, page, sizeof(pgIdx));
+            bufferPool.unpinPage(freePages.back(), false);
 
-    // Reads physical block from index file and represents the block logically
-    void readBlock(fstream &inputFile) {
+        }
 
-        // First get to physical block in index file with seekg()
-        inputFile.seekg(blockIdx * PAGE_SIZE);
+        sort(freePages.begin(), freePages.end());
 
-        // All blocks are initialized with overflow pointer and number of records
-        // so we always read these in.
-        inputFile.read(reinterpret_cast<char *>(&overflowPtrIdx), sizeof(overflowPtrIdx));
-        inputFile.read(reinterpret_cast<char *>(&numRecords), sizeof(numRecords));
+        // Drop free pages from the end of the file
+        int oldNumPages = nextFreePage;
+        while (!freePages.empty() && freePages.back() == nextFreePage - 1) {
+            freePages.pop_back();
+            nextFreePage--;
+        }
 
-        cout << "\n" << "v-------------------------------------------v" << endl;
-        cout << "[READING BLOCK]" << endl;
-        cout << "Overflow idx: " << overflowPtrIdx << endl;
-        cout << "# of records: " << numRecords << endl;
+        // Relink whatever is left, highest page first so the lowest one ends up at the head
+        freeListHead = -1;
+        numFreePages = 0;
+        for (int f = (int)freePages.size() - 1; f >= 0; f--)
+            freePage(freePages[f]);
 
-        // Add to block size 8 since overflow idx and number of records are 4 bytes each
-        blockSize += 8;
+        commitOperation(directorySize);
 
-        // Now read the number of records in the block
-        for (int i = 0; i < numRecords; i++) {
+        // Pages past the new end may still be cached, write everything back (checkpointing the log,
+        // so nothing past the new end gets replayed) and drop the cache before cutting the file
+        persist();
+        bufferPool.reset();
+        indexFile->truncate(nextFreePage);
 
-            readRecord(inputFile);
+        LHI_LOG(LOG_INFO, "Compacted index " << fName << " from " << oldNumPages << " to " << nextFreePage << " pages");
 
-            // Update block size as records are being pushed back into vector
-            // read current index as a record was just pushed back into vector
-            // at that index
-            blockSize += records[i].calcSize();
-            cout << "**** Current Block's Size: " << blockSize << endl;
+        if (heap)
+            compactHeap();
 
+        if constexpr (HasSecondaryKey<Serializer>) {
+            if (secondary)
+                secondary->compact();
         }
 
-        cout << "^-------------------------------------------^" << "\n" << endl;
+        return oldNumPages - nextFreePage;
 
     }
-};
 
+    // Read csv file and add records to the index
+    void createFromFile(string csvFName) {
+        
+        // Open filestream to index file (we read and write from index so in and out both set) and a reader for the .csv file
+        // Index file stays open after the build so lookups can reuse the cached pages
+        createIndexFile();
 
-class LinearHashIndex {
+        CsvReader reader(csvFName);
+        vector<string_view> fields;
 
-private:
-    const int PAGE_SIZE = 4096;
+        if (reader.isOpen())
+            LHI_LOG(LOG_INFO, csvFName << " opened");
 
-    vector<int> pageDirectory;  // Where pageDirectory[h(id)] gives page index of block
-                                // can scan to pages using index*PAGE_SIZE as offset (using seek function)
-    int numBlocks; // Now is actual count of blocks including overflow
+        /* Loop through input file and add all records with insertRecord function
+         * Each row is inserted from a view into the reader's buffer, no Rec is built
+         */
+        while (reader.nextRow(fields))
+            insertRecord(Serializer::parseCsvRow(fields));
 
-    // determines the index for page directory (index value of bucket which the last i bits need to match)
-    // the page directory then returns an index which is technically in offset into the actual file to read
-    // an abstract arbitrary block in index file.
-    int numBuckets; // buckets are not the same as blocks (bucket point to block, block hold records) // n
-    int i;
-    int numRecords; // Records in index
-    int nextFreePage; // Next page to write to
-    string fName; // Name of output index file
+        LHI_LOG(LOG_DEBUG, "All records read!");
 
-    // Bookkeeping vars for debugging and statistics
-    int numOverflowBlocks;
+        // Log stats for validation of results
+        LHI_LOG(LOG_INFO, stats());
 
-    // Vars for calculating average number of records per block
-    int currentTotalSize;
+        // Persist metadata and write back dirty pages so the index file on disk is complete
+        flush();
 
-    // Get record from input file (convert .csv row to Record data structure)
-    Record getRecord(fstream &recordIn) {
+    }
 
-        string line, word;
+    // Build the index from a csv file in one go instead of inserting record by record
+    // 1. First pass over the csv counts records and bytes so the final number of buckets (and i)
+    //    can be picked up front: the smallest n that keeps the average bucket under the split threshold
+    //    (with SPLIT_ON_UTILIZATION, the other split policies get the same fill factor)
+    // 2. Second pass hashes every record to its final bucket. Buckets are collected in memory if the
+    //    records fit in memoryBudget bytes, otherwise they are spilled to run files on disk that each hold
+    //    a contiguous range of buckets and are loaded back one at a time
+    // 3. Each bucket's chain (base block + overflow blocks) is laid out once and written sequentially
+    // The layout isn't the one createFromFile() ends up with: the bucket count can differ by a few, and
+    // chains are laid out without the gaps that splits leave in blocks, so there are fewer overflow blocks
+    // (about 40% fewer on index_bench data). Records keep csv order within each bucket, and none are
+    // rewritten by splits along the way
+    void bulkLoadFromFile(string csvFName, size_t memoryBudget = (size_t)256 << 20) {
+
+        lock_guard<mutex> writerLock(writerMutex);
+
+        createIndexFile();
+
+        // First pass, only sizes are kept
+        long long totalRecords = 0;
+        long long totalRecordBytes = 0;     // what the records add to currentTotalSize
+        long long totalEncodedBytes = 0;    // what they take up when partitioned
+
+        vector<string_view> fields;
+        vector<char> buffer;
+        CsvReader sizingReader(csvFName);
+
+        while (sizingReader.nextRow(fields)) {
+            View record = storedForm(Serializer::parseCsvRow(fields), compressRecords, buffer);
+            totalRecords++;
+            totalRecordBytes += storedSize(record);
+            totalEncodedBytes += sizeof(int) + Serializer::encodedSize(record);
+        }
 
-        // Make vector of strings (fields of record)
-        // to pass to constructor of Record struct
-        vector<std::string> fields;
+        if (totalRecords > 0) {
 
-        // grab entire line
-        if (getline(recordIn, line, '\n'))
-        {
-            // turn line into a stream
-            stringstream s(line);
-
-            // gets everything in stream up to comma
-            // and store in respective field in fields vector
-            getline(s, word, ',');
-            fields.push_back(word);
-            getline(s, word, ',');
-            fields.push_back(word);
-            getline(s, word, ',');
-            fields.push_back(word);
-            getline(s, word, ',');
-            fields.push_back(word);
-
-            return Record(fields);
-        }
-        else
-        {
-            // Put error indicator in first field
-            fields.push_back("-1");
-            fields.push_back("-1");
-            fields.push_back("-1");
-            fields.push_back("-1");
-            return Record(fields);
+            // Final split state
+            presizeBuckets(totalRecordBytes);
 
-        }
+            // Split bucket range into as many runs as needed to stay within the memory budget
+            int numRuns = max(1LL, (long long)((totalEncodedBytes + memoryBudget - 1) / memoryBudget));
+            numRuns = min(numRuns, numBuckets.load());
 
-    }
+            vector<int> runFirstBucket;
+            for (int run = 0; run <= numRuns; run++)
+                runFirstBucket.push_back((long long)run * numBuckets / numRuns);
 
-    // Hash function
-    int hash(int id) {
-        return (id % (int)pow(2, 16));
-    }
+            // Second pass
+            CsvReader reader(csvFName);
 
-    // Function to get last i'th bits of hash value
-    int getLastIthBits(int hashVal, int i) {
-        return hashVal & ((1 << i) - 1);
-    }
+            if (numRuns == 1) {
 
-    // Initializes a bucket/block
-    // Block format:
-    // overflow pointer (integer offset index to overflow block in index file), number of records, and then
-    // records with delimiters
-    // For creating entirely new buckets, not for overflow blocks in existing bucket
-    // Return LOGICAL BUCKET index (not physical offset index!!!!)
-    int initBucket(fstream &indexFile) {
+                vector<vector<char>> buckets(numBuckets);
 
-        int overflowIdx = -1;
-        int defaultNumRecords = 0;
+                while (reader.nextRow(fields)) {
+                    View record = storedForm(Serializer::parseCsvRow(fields), compressRecords, buffer);
+                    appendToPartition(buckets[getBucketIdx(Serializer::key(record))], record);
+                }
 
-        // Pre-write overflow pointer (4 bytes) and number of records (4 byte) to the blocks at the buckets
-        // Default overflow pointer value is -1 (since we don't overflow yet), and number of records is 0 for empty block
-        indexFile.seekp(nextFreePage * PAGE_SIZE);
+                BuildCounters counters;
+                vector<char> chainBuffer;
+                for (int bucketIdx = 0; bucketIdx < numBuckets; bucketIdx++)
+                    writeBulkBucket(bucketIdx, partitionRecords(buckets[bucketIdx]), chainBuffer, counters);
+                addBuildCounters(counters);
 
-        indexFile.write(reinterpret_cast<const char *>(&overflowIdx), sizeof(overflowIdx));
-        indexFile.write(reinterpret_cast<const char *>(&defaultNumRecords), sizeof(defaultNumRecords));
+            }
+            else {
 
-        // Bucket index is based on number of blocks starting at 0
-        // update numBuckets when creating buckets
-        // We want to have phys index based on # of blocks because we can allocate more blocks outside
-        // of this function and so we want the latest free block index for the bucket
-        // # of bucket probably < # of blocks most of the time, so if we allocate phys idx by # of buckets
-        // we would allocate an already used phys idx most likely
-        pageDirectory.push_back(nextFreePage++);
-        numBlocks++;
-        numBuckets++;
+                // Spill every record to the run holding its bucket: bucket index, then length prefixed record
+                vector<string> runNames;
+                vector<fstream> runFiles(numRuns);
+                for (int run = 0; run < numRuns; run++) {
+                    runNames.push_back(fName + ".run" + to_string(run));
+                    runFiles[run].open(runNames[run], ios::out | ios::trunc | ios::binary);
+                }
 
-        // Update current total size
-        currentTotalSize += sizeof(overflowIdx) + sizeof(defaultNumRecords);
+                vector<char> encoded;
+                while (reader.nextRow(fields)) {
 
-        return pageDirectory.size() - 1;
-        
-    }
+                    View record = storedForm(Serializer::parseCsvRow(fields), compressRecords, buffer);
+                    int bucketIdx = getBucketIdx(Serializer::key(record));
+                    int run = upper_bound(runFirstBucket.begin(), runFirstBucket.end(), bucketIdx) - runFirstBucket.begin() - 1;
 
-    // Create overflow block (we DON'T ADD TO PAGE DIRECTORY SINCE NOT NEW BUCKET!) on existing bucket
-    // We also need to overwrite the overflow index pointer of the block that points
-    // to this overflow block
-    // Returns physical offset index of overflow block
-    int initOverflowBlock(int parentBlockIdx, fstream &indexFile) {
+                    encoded.clear();
+                    appendToPartition(encoded, record);
+                    runFiles[run].write(reinterpret_cast<const char *>(&bucketIdx), sizeof(bucketIdx));
+                    runFiles[run].write(encoded.data(), encoded.size());
 
-        int overflowIdx = -1;
-        int defaultNumRecords = 0;
+                }
 
-        // Get index of current overflow block
-        int currIdx = nextFreePage++;
+                for (int run = 0; run < numRuns; run++)
+                    runFiles[run].close();
 
-        // Write boilerplate block info (overflow index to NEXT OVERFLOW BLOCK and # of records)
-        // which are initial values since this is fresh overflow block
-        indexFile.seekp(currIdx * PAGE_SIZE);
+                // Load runs back one at a time (runs are in bucket order, so pages stay sequential)
+                for (int run = 0; run < numRuns; run++) {
 
-        indexFile.write(reinterpret_cast<const char *>(&overflowIdx), sizeof(overflowIdx));
-        indexFile.write(reinterpret_cast<const char *>(&defaultNumRecords), sizeof(defaultNumRecords));
+                    int firstBucket = runFirstBucket[run];
+                    vector<vector<char>> buckets(runFirstBucket[run + 1] - firstBucket);
 
-        // Rewrite parent block's overflow index to point to this current index to link parent to current
-        // Overflow index is first 4 bytes so immediately just overwrite the first 4 bytes with current index
-        indexFile.seekp(parentBlockIdx * PAGE_SIZE);
-        indexFile.write(reinterpret_cast<const char *>(&currIdx), sizeof(currIdx));
+                    fstream runFile(runNames[run], ios::in | ios::binary);
+                    int bucketIdx, recordLength;
 
-        // Update current total size (8 new bytes only, since 4 bytes of the parent are already counted)
-        currentTotalSize += sizeof(overflowIdx) + sizeof(defaultNumRecords);
+                    while (runFile.read(reinterpret_cast<char *>(&bucketIdx), sizeof(bucketIdx))) {
 
-        // Update number of overflow blocks and blocks
-        numBlocks++;
-        numOverflowBlocks++;
+                        runFile.read(reinterpret_cast<char *>(&recordLength), sizeof(recordLength));
 
-        // Return index of current overflow block
-        return currIdx;
-        
-    }
+                        vector<char> &partition = buckets[bucketIdx - firstBucket];
+                        size_t oldSize = partition.size();
+                        partition.resize(oldSize + sizeof(int) + recordLength);
+                        memcpy(&partition[oldSize], &recordLength, sizeof(recordLength));
+                        runFile.read(&partition[oldSize + sizeof(int)], recordLength);
+
+                    }
 
-    // Initialize empty block, return physical offset index to new block
-    int initEmptyBlock(fstream &indexFile) {
+                    runFile.close();
+                    remove(runNames[run].c_str());
 
-        int overflowIdx = -1;
-        int defaultNumRecords = 0;
+                    BuildCounters counters;
+                    vector<char> chainBuffer;
+                    for (int b = 0; b < (int)buckets.size(); b++)
+                        writeBulkBucket(firstBucket + b, partitionRecords(buckets[b]), chainBuffer, counters);
+                    addBuildCounters(counters);
 
-        // Get index for current block
-        int currIdx = nextFreePage++;
+                }
 
-        indexFile.seekp(currIdx * PAGE_SIZE);
+            }
 
-        indexFile.write(reinterpret_cast<const char *>(&overflowIdx), sizeof(overflowIdx));
-        indexFile.write(reinterpret_cast<const char *>(&defaultNumRecords), sizeof(defaultNumRecords));
+            finishBulkSplits();
 
-        // Update current total size (8 new bytes only, since 4 bytes of the parent are already counted)
-        currentTotalSize += sizeof(overflowIdx) + sizeof(defaultNumRecords);
+        }
 
-        // Update number of blocks
-        numBlocks++;
+        LHI_LOG(LOG_INFO, stats());
 
-        return currIdx;
+        rebuildSecondaryIndex();
+        persist();
 
     }
 
-    // Modular function to write record to physical file
-    // Reducing redundancy
-    // NOTE: MEETS THREE BLOCKS REQUIREMENT, WE LOOK AT ONE BLOCK AT A TIME TO SEE IF
-    // WE CAN WRITE RECORD THERE, OTHERWISE WE CHECK OR CREATE OVERFLOW BLOCKS
-    void writeRecordToIndexFile(Record record, int baseBlockPgIdx, fstream &indexFile) {
+    // Same result as bulkLoadFromFile() but spread across numThreads threads (all cores by default)
+    // 1. The csv is cut into byte ranges and each thread parses the lines of its range into its own arena
+    // 2. Once the total size is known the final number of buckets is picked, and each thread hash partitions
+    //    its records into one queue per worker, where every worker owns a disjoint range of buckets
+    // 3. Each worker drains the queues for its range (in csv chunk order so records stay in csv order)
+    //    and lays out and writes the pages of its buckets, allocating pages through allocatePages()
+    // Everything is kept in memory, use bulkLoadFromFile() for csv files bigger than memory
+    void parallelBulkLoadFromFile(string csvFName, int numThreads = 0) {
 
-        bool hasWrittenRecord = false;
+        if (numThreads <= 0)
+            numThreads = max(1u, thread::hardware_concurrency());
 
-        while (!hasWrittenRecord) {
+        lock_guard<mutex> writerLock(writerMutex);
 
-            // Read/parse current block that we just indexed to
-            Block currBlock(baseBlockPgIdx);
-            currBlock.readBlock(indexFile);
+        createIndexFile();
 
-            // Check if current record fits inside current block,
-            // if not then see if there is overflow and check overflow for space
-            // if there isn't, then create overflow and write record there
-            if (currBlock.blockSize + record.calcSize() <= PAGE_SIZE) {
-                
-                cout << "== New block size after record added: " << currBlock.blockSize + record.calcSize() << "\n" << endl;
+        ifstream sizeProbe(csvFName, ios::in | ios::binary | ios::ate);
+        long long fileSize = sizeProbe.is_open() ? (long long)sizeProbe.tellg() : 0;
+        sizeProbe.close();
 
-                // Record fits completely within block, so write at empty spot
-                // (Move file pointer up to current blockSize and write record there)
-                indexFile.seekp((baseBlockPgIdx * PAGE_SIZE) + currBlock.blockSize);
-                record.writeRecord(indexFile);
+        // Phase 1: parse chunks
+        vector<ParsedChunk> chunks(numThreads);
+        runOnThreads(numThreads, [&](int t) {
+            parseCsvChunk(csvFName, fileSize * t / numThreads, fileSize * (t + 1) / numThreads, chunks[t]);
+        });
 
-                // Update current block's # of records field
-                int newNumRecords = currBlock.numRecords + 1;
-                // Move to start of block and jump over 4 bytes of overflow index to write at # of records field
-                indexFile.seekp((baseBlockPgIdx * PAGE_SIZE) + sizeof(int));
-                indexFile.write(reinterpret_cast<const char *>(&newNumRecords), sizeof(newNumRecords));
+        long long totalRecordBytes = 0;
+        for (ParsedChunk &chunk : chunks)
+            totalRecordBytes += chunk.recordBytes;
 
-                // Update current total size
-                currentTotalSize += record.calcSize();
+        if (totalRecordBytes > 0) {
 
-                // Set flag to true because we wrote record
-                hasWrittenRecord = true;
+            // Final split state
+            presizeBuckets(totalRecordBytes);
 
-            }
-            else if (currBlock.overflowPtrIdx != -1) {
-                
-                // This means that current block is full, but there exists a linked overflow block
-                cout << "== Block full w/ overflow block, moving to existing overflow block w/ physical index " << currBlock.overflowPtrIdx << "\n" << endl;
+            int numWorkers = min(numThreads, numBuckets.load());
+            vector<int> workerFirstBucket;
+            for (int w = 0; w <= numWorkers; w++)
+                workerFirstBucket.push_back((long long)w * numBuckets / numWorkers);
 
-                // Set baseBlockPgIdx to overflow idx of the current block so that next loop iteration the currBlock
-                // will be the overflow block and we can continue this iteration logic for writing record
-                baseBlockPgIdx = currBlock.overflowPtrIdx;
+            // Phase 2: queues[t][w] holds (bucket, record) of chunk t that go to worker w
+            vector<vector<vector<pair<int, const char *>>>> queues(numThreads, vector<vector<pair<int, const char *>>>(numWorkers));
 
-            }
-            else {
+            runOnThreads(numThreads, [&](int t) {
 
-                // Create overflow since no overflow block exists
-                cout << "== Block full and no overflow block. Creating overflow block..." << "\n" << endl;
+                ParsedChunk &chunk = chunks[t];
 
-                // Initialize overflow block and return its physical offset index
-                int overflowIdx = initOverflowBlock(baseBlockPgIdx, indexFile);
+                for (size_t r = 0; r < chunk.ids.size(); r++) {
+                    int bucketIdx = getBucketIdx(chunk.ids[r]);
+                    int w = upper_bound(workerFirstBucket.begin(), workerFirstBucket.end(), bucketIdx) - workerFirstBucket.begin() - 1;
+                    queues[t][w].push_back({bucketIdx, &chunk.arena[chunk.offsets[r]]});
+                }
 
-                // Now move to overflow block and write record after the overflow index and # of records in that block
-                indexFile.seekp((overflowIdx * PAGE_SIZE) + sizeof(int) + sizeof(int));
-                record.writeRecord(indexFile);
+            });
 
-                // Update current block's # of records field (only 1 record after writing current record into overflow block)
-                int newNumRecords = 1;
-                // Move to start of block and jump over 4 bytes of overflow index to write at # of records field
-                indexFile.seekp((overflowIdx * PAGE_SIZE) + sizeof(int));
-                indexFile.write(reinterpret_cast<const char *>(&newNumRecords), sizeof(newNumRecords));
+            // Phase 3: every worker writes its own bucket range
+            vector<BuildCounters> workerCounters(numWorkers);
 
-                // Update current total size
-                currentTotalSize += record.calcSize();
+            runOnThreads(numWorkers, [&](int w) {
 
-                // Set flag
-                hasWrittenRecord = true;
+                vector<pair<int, const char *>> workerRecords;
+                for (int t = 0; t < numThreads; t++)
+                    workerRecords.insert(workerRecords.end(), queues[t][w].begin(), queues[t][w].end());
 
-            }
+                // Group by bucket, stable so records keep their csv order within the bucket
+                stable_sort(workerRecords.begin(), workerRecords.end(),
+                            [](const pair<int, const char *> &a, const pair<int, const char *> &b) { return a.first < b.first; });
+
+                vector<const char *> bucketRecords;
+                vector<char> chainBuffer;
+                size_t next = 0;
+
+                // Every bucket gets a base block, even ones no record hashed to
+                for (int bucketIdx = workerFirstBucket[w]; bucketIdx < workerFirstBucket[w + 1]; bucketIdx++) {
+
+                    bucketRecords.clear();
+                    while (next < workerRecords.size() && workerRecords[next].first == bucketIdx)
+                        bucketRecords.push_back(workerRecords[next++].second);
+
+                    writeBulkBucket(bucketIdx, bucketRecords, chainBuffer, workerCounters[w]);
+
+                }
+
+            });
+
+            for (BuildCounters &counters : workerCounters)
+                addBuildCounters(counters);
+
+            finishBulkSplits();
 
         }
 
+        LHI_LOG(LOG_INFO, stats());
+
+        rebuildSecondaryIndex();
+        persist();
+
     }
 
-    // Insert new record into index
-    void insertRecord(Record record, fstream &indexFile) {
+    // Probe the bucket chain of id and call onMatch with a view (Serializer::View) of the record if it is found
+    // (the view is only valid inside onMatch), see probeEncoded()
+    // Returns false if no record has the id
+    template <class Callback>
+    bool probeRecord(const Key &id, Callback &&onMatch) {
+        return probeEncoded(id, [&onMatch](const char *recordData, int recordLength) {
+            onMatch(Serializer::view(recordData, recordLength));
+        });
+    }
 
-        // No records written to index yet
-        if (numRecords == 0) {
-            // Initialize index with first blocks (start with 2)
-            // buckets
-            for (int i = 0; i < 2; i++) {
-                initBucket(indexFile);
+    // Current counters of the index (what the builds log as [FINAL STATS])
+    IndexStats stats() const {
+
+        IndexStats current;
+        current.pageSize = PAGE_SIZE;
+        current.numBuckets = numBuckets;
+        current.numBlocks = numBlocks;
+        current.numOverflowBlocks = numOverflowBlocks;
+        current.numFreePages = numFreePages;
+        current.numRecords = numRecords;
+        current.numPages = nextFreePage;
+        if (current.numBuckets > 0)
+            current.avgBucketCapacity = (double)currentTotalSize / ((double)current.numBuckets * PAGE_SIZE);
+
+        return current;
+
+    }
+
+    // Number of blocks (base block + overflow blocks) in the chain of every bucket, in bucket order
+    // Shows how evenly the hash function spreads the keys
+    vector<int> chainLengths() {
+
+        lock_guard<mutex> writerLock(writerMutex);
+
+        vector<int> lengths;
+        for (int bucketIdx = 0; bucketIdx < numBuckets; bucketIdx++) {
+
+            int length = 0;
+            for (int pgIdx = pageDirectory[bucketIdx]; pgIdx != -1; length++) {
+                SlottedPage page(bufferPool.fetchPage(pgIdx), PAGE_SIZE);
+                int nextPgIdx = page.overflowPtr();
+                bufferPool.unpinPage(pgIdx, false);
+                pgIdx = nextPgIdx;
             }
 
-            // 1 bit needed to address 2 buckets/blocks
-            i = 1;
-            
+            lengths.push_back(length);
+
         }
 
-        // Add record to the index in the correct block, creating overflow block if necessary
-        // hash to get index hash and then take last i'th bits to get bucket index
-        int bucketIdx = getLastIthBits(hash(record.id), i);
+        return lengths;
 
-        // Debug print last i'th bits
-        cout << "Bucket index: " << bucketIdx << endl;
-        cout << "Last " << i << " bit(s): " << bitset<16>(bucketIdx) << endl;
-        
+    }
 
-        // If value of last i'th bits >= n, then set MSB from 1 to 0
-        // Deals with virtual/ghost buckets
-        if (bucketIdx >= numBuckets) {
-            cout << "Set bucket index MSB to 0, # of buckets is: " << numBuckets << endl;
-            bucketIdx &= ~(1 << (i-1));
+    // Counters of the index for monitoring it and tuning it against a workload (the split threshold, the
+    // number of frames, ...), exported with IndexMetrics::toJson(). Lookup latency covers the single key
+    // lookups (probeRecord(), findRecordById()), findRecordsByIds() isn't timed.
+    // The chain length histogram walks every bucket chain, so it reads every block of the index
+    // (the I/O counters are taken before it does)
+    IndexMetrics metrics() {
+
+        IndexMetrics current;
+        current.shape = stats();
+
+        const IoCounters &io = indexFile->ioCounters;
+        current.pageReads = io.pageReads;
+        current.pageWrites = io.pageWrites;
+        current.bytesRead = io.bytesRead;
+        current.bytesWritten = io.bytesWritten;
+        current.syncs = io.syncs;
+        current.cacheHits = bufferPool.numCacheHits();
+        current.cacheMisses = bufferPool.numCacheMisses();
+        current.evictions = bufferPool.numEvictions();
+
+        if (heap) {
+            current.heapReads = heap->ioCounters.pageReads;
+            current.heapBytesRead = heap->ioCounters.bytesRead;
+            current.heapBytes = heap->size();
         }
-        
-        // then insert in index file at the bucket index (pgdir[bucket_idx] gives actual offset idx for index file)
-        int pgIdx = pageDirectory[bucketIdx];
-        cout << "Physical offset index of bucket index " << bucketIdx << ": " << pgIdx << endl;
 
-        // Write at that block spot in index file, delimit variable record with '~'
-        // FIND EMPTY SPOT WITHIN BLOCK IF POSSIBLE OTHERWISE OVERFLOW
-        // READ BLOCK/PARSE BLOCK, THEN USE CALCSIZE FUNCTION TO CALCULATE TAKEN SPACE AND THEN THE NEXT
-        // FREE BYTE SPOT TO WRITE RECORD TO (MOVE WITH SEEKP TO THAT SPOT) THEN WRITE RECORD
+        current.numSplits = numSplits;
+        current.numMerges = numMerges;
+        current.splitLatency = splitLatency.summary();
+        current.insertLatency = insertLatency.summary();
+        current.lookupLatency = lookupLatency.summary();
 
-        // We may or may not need to navigate through multiple blocks before writing record
-        // Especially if there are multiple overflow blocks
-        // This flag is to mark when we've written the record, otherwise we continue iterating
-        // through overflow blocks if they exist until we find a spot to put the record (if the
-        // initial block is full that is)
+        for (int length : chainLengths()) {
+            if (length >= (int)current.chainLengthHistogram.size())
+                current.chainLengthHistogram.resize(length + 1, 0);
+            current.chainLengthHistogram[length]++;
+        }
 
-        writeRecordToIndexFile(record, pgIdx, indexFile);
+        return current;
 
-        // Increment # of records
-        numRecords++;
+    }
 
-        // Take neccessary steps if capacity is reached
-        // Calculate average bytes capacity per bucket (not block) is > 70%
-        double avgCapacityPerBucket = (double)currentTotalSize / numBuckets;
-
-        // 70% of block capacity is 70% of 4096 or .7 * 4096
-        if (avgCapacityPerBucket > 0.7 * PAGE_SIZE) {
-
-            // Add a new bucket
-            // Note: numBuckets is incremented at this point
-            // Find bucket to rehash and move to new bucket
-            int newBucketIdx = initBucket(indexFile);
-
-            // Now calculate the number of binary digits needed to address the new bucket
-            // ex. For third bucket with index 2, we need 2 binary digits to address 3 buckets
-            int digitsToAddrNewBucket = (int)ceil(log2(numBuckets));
-
-            /* Rehash some search keys into this new bucket
-             * calculate the index of the real bucket that was used to hold
-             * records when the new bucket was still a ghost bucket
-             * ex. When adding third bucket, before third bucket with index 2 (binary: 10)
-             * was added, keys that were hashed to index 2 (binary: 10) had their MSB
-             * set to 0 to get a real bucket whose index was < than # of buckets, which
-             * in this case was bucket 0. So we rehash everything in bucket 0 to see if they need
-             * to be moved to the new bucket which now exists and is no longer a ghost bucket
-             */
-            int realBucketToMoveRecordsFromIdx = newBucketIdx;
-            realBucketToMoveRecordsFromIdx &= ~(1 << (digitsToAddrNewBucket - 1));
-
-            // Debug prints
-            cout << "** Number of buckets: " << numBuckets << endl;
-            cout << "** New bucket index (numBuckets - 1): " << newBucketIdx << endl;
-            cout << "** New bucket index binary (numBuckets - 1): " << bitset<16>(newBucketIdx) << endl;
-            cout << "** Real bucket index to rehash to new bucket (binary): " << bitset<16>(realBucketToMoveRecordsFromIdx) << endl;
-
-            // Ghost bucket is now a real new bucket, move ghost search keys to this new real bucket
-            int realBucketToMoveRecordsFromPgIdx = pageDirectory[realBucketToMoveRecordsFromIdx];
-            
-            // Iterate through entire bucket (base block + overflow blocks) and any ghost keys to new real bucket
-            // NOTE: TO AVOID HAVING TO MANUALLY DELETE RECORDS FROM A BLOCK (WHICH IS EITHER TEDIOUS OR HEAVY ON I/O)
-            // WE INSTEAD CHOOSE TO ALLOCATE TWO NEW BLOCKS, ONE IS THE FOR "NEW" OLD BUCKET AND ONE IS NEW REAL BUCKET, WRITE THE RECORDS
-            // TO THE RESPECTIVE BUCKET OF THE TWO AND DELETE THE TRUE OLD BUCKET THAT WE WOULD ACTUALLY REMOVE RECORDS FROM
+    // Start counting from zero again (e.g. after the build, to measure just the workload that follows)
+    void resetMetrics() {
+        indexFile->ioCounters.reset();
+        if (heap)
+            heap->ioCounters.reset();
+        bufferPool.resetCounters();
+        numSplits = 0;
+        numMerges = 0;
+        insertLatency.reset();
+        lookupLatency.reset();
+        splitLatency.reset();
+    }
 
-            // We now allocate second block for "new" old block which is basically the old block without the ghost keys after this process
-            int newOldBucketPgIdx = initEmptyBlock(indexFile);
+    // Given an ID, find the relevant record and return it
+    // If there is no record with the ID, Serializer::missingRecord() is returned (id of -1 for employees)
+    Rec findRecordById(const Key &id) {
 
-            while (realBucketToMoveRecordsFromPgIdx != -1) {
+        optional<Rec> found;
 
-                // Read block at old bucket with ghost keys
-                Block oldBlock(realBucketToMoveRecordsFromPgIdx);
-                oldBlock.readBlock(indexFile);
+        probeEncoded(id, [&found](const char *recordData, int recordLength) {
+            found = Serializer::read(recordData, recordLength);
+        });
 
-                // Parsed entire block in Block object, so we can cleanup
-                // block by blanking out entire block with asterisks
-                cout << "Cleaning up block at physical index " << oldBlock.blockIdx << endl;
-                indexFile.seekp(oldBlock.blockIdx * PAGE_SIZE);
-                indexFile << string(PAGE_SIZE, '*');
+        return found ? std::move(*found) : Serializer::missingRecord();
 
-                // Decrement number of blocks and numOverflowBlock (but increment # of overflow block again after since first
-                // block is not overflow)
-                numBlocks--;
-                numOverflowBlocks--;
+    }
 
-                // Update size and number of records, we "zero" out entire block, but only the block's size
-                // of data is removed
-                currentTotalSize -= oldBlock.blockSize;
-                numRecords -= oldBlock.numRecords;
-
-                // Check each record in old block and determine which record goes to which block
-                // NOTE: MEETS THREE BLOCKS REQUIREMENT, WE LOOK AT ONE BLOCK AT A TIME IN EACH CONDITIONAL BRANCH
-                // TO SEE IF WE CAN INSERT A RECORD IN THAT BLOCK FOR THE BUCKET, OTHERWISE WE CHECK OR CREATE OVERFLOW BLOCKS
-                // (EVEN IF YOU CONSIDER THIS TWO BLOCKS IN MEMORY AT THE SAME TIME BECAUSE OF THE TWO BUCKET "BRANCHES" IT STILL
-                // MEETS REQUIREMENTS OF BEING UNDER THREE SINCE IN EACH BRANCH WE ONLY LOOK AT ONE BLOCK AT A TIME MEANING THAT
-                // ONLY TWO BLOCKS AT MOST ARE EVER LOADED IN MAIN MEMORY AT ONCE)
-                for (int i = 0; i < oldBlock.numRecords; i++) {
-
-                    // Consider last digitsToAddrNewBucket number of bits for each record
-                    // If it matches the index of the new bucket then move to new bucket's block
-                    // otherwise write to new old bucket block.
-                    // Ex. For third new bucket at index 2 (binary: 10), we look at index 0 bucket for rehash and moving
-                    // ghost keys; we now need to consider last 2 binary digits for each hashed id to see if it stays in current old
-                    // bucket (last binary digits are 00) or gets moved to new bucket at index 2 (last binary digits are 10).
-                    if (getLastIthBits(hash(oldBlock.records[i].id), digitsToAddrNewBucket) == newBucketIdx) {
-
-                        // Put record in new bucket
-                        int newBucketBlockPgIdx = pageDirectory[newBucketIdx];
-                        writeRecordToIndexFile(oldBlock.records[i], newBucketBlockPgIdx, indexFile);
+    // Look up many IDs at once. Keys are grouped by the bucket they hash to so each needed
+    // bucket chain is walked only once no matter how many of the keys share it, and chains are
+    // visited in physical page order of their base blocks. Results come back in the same order
+    // as ids, with std::nullopt for every ID that isn't in the index.
+    // If a split changes the directory half way through, keys of the buckets not visited yet are
+    // grouped again against the new directory.
+    vector<optional<Rec>> findRecordsByIds(span<const Key> ids) {
 
-                    }
-                    else {
+        vector<optional<Rec>> results(ids.size());
+        vector<char> buffer;
 
-                        // Put record in "new" old bucket that will have all ghost keys removed
-                        int tempNewOldBlockPgIdx = newOldBucketPgIdx;
-                        writeRecordToIndexFile(oldBlock.records[i], tempNewOldBlockPgIdx, indexFile);
+        // Positions in ids that still have to be looked up
+        vector<int> pending(ids.size());
+        for (int pos = 0; pos < (int)ids.size(); pos++)
+            pending[pos] = pos;
 
-                    }
+        while (!pending.empty() && numBuckets > 0) {
 
-                    numRecords++;
+            uint64_t version = directoryVersion.load(memory_order_acquire);
+            if (version & 1) {
+                this_thread::yield();
+                continue;
+            }
 
-                }
+            // (physical page of bucket's base block, bucket index, position in ids) for every key
+            // Base page is copied in since a concurrent split may change it while sorting
+            vector<tuple<int, int, int>> keysByBucket;
+            keysByBucket.reserve(pending.size());
+            for (int pos : pending) {
+                int bucketIdx = getBucketIdx(ids[pos]);
+                keysByBucket.push_back({0, bucketIdx, pos});
+            }
 
-                // Move up realBucketToMoveRecordsFromPgIdx iterator to its overflow index to continue outer while loop to rehash
-                // all records in the bucket including overflow block records
-                realBucketToMoveRecordsFromPgIdx = oldBlock.overflowPtrIdx;
+            if (directoryVersion.load(memory_order_acquire) != version)
+                continue;
 
-            }
-            
-            // Increment overflow block again because first block in bucket is not overflow
-            numOverflowBlocks++;
+            for (tuple<int, int, int> &key : keysByBucket)
+                get<0>(key) = pageDirectory[get<1>(key)];
 
-            // Re-hook up the pageDirectory to point to these new blocks for the old bucket
-            pageDirectory[realBucketToMoveRecordsFromIdx] = newOldBucketPgIdx;
+            // Sort by physical page of the bucket's base block so the file is read front to back
+            // (keys of one bucket end up next to each other since base pages are unique per bucket)
+            sort(keysByBucket.begin(), keysByBucket.end());
 
-            // Update i as well
-            i = digitsToAddrNewBucket;
+            pending.clear();
+            size_t groupStart = 0;
 
-        }
+            while (groupStart < keysByBucket.size()) {
 
-    }
+                // Find all keys that go to this bucket
+                int bucketIdx = get<1>(keysByBucket[groupStart]);
+                size_t groupEnd = groupStart;
+                while (groupEnd < keysByBucket.size() && get<1>(keysByBucket[groupEnd]) == bucketIdx)
+                    groupEnd++;
 
-public:
-    LinearHashIndex(string indexFileName) {
-        numBlocks = 0;
-        i = 0;
-        numRecords = 0;
-        numBuckets = 0;
-        fName = indexFileName;
-        numOverflowBlocks = 0;
-        currentTotalSize = 0;
-        nextFreePage = 0;
-    }
+                BucketLatch &latch = pageDirectory.latch(bucketIdx);
+                latch.lockShared();
 
-    // Read csv file and add records to the index
-    void createFromFile(string csvFName) {
-        
-        // Open filestream to index file (we read and write from index so in and out both set) and another to .csv file
-        fstream indexFile(fName, ios::in | ios::out | ios::trunc | ios::binary);
-        fstream inputFile(csvFName, ios::in);
+                // Directory changed since the keys were grouped, redo the rest
+                if (directoryVersion.load(memory_order_acquire) != version) {
+                    latch.unlockShared();
+                    for (size_t k = groupStart; k < keysByBucket.size(); k++)
+                        pending.push_back(get<2>(keysByBucket[k]));
+                    break;
+                }
 
-        if (inputFile.is_open())
-            cout << "Employee.csv opened" << endl;
+                int keysRemaining = groupEnd - groupStart;
+                int pgIdx = pageDirectory[bucketIdx];
 
-        /* Loop through input file and get all records to add
-         * with insertRecord function
-         */
+                // Walk the chain once, searching every block's tag column for every key of the group still missing
+                while (pgIdx != -1 && keysRemaining > 0) {
 
-        // Flag for checking when we are done reading input file
-        bool recordsRemaining = true;
+                    SlottedPage currPage(bufferPool.fetchPage(pgIdx), PAGE_SIZE);
 
-        while (recordsRemaining) {
+                    for (size_t k = groupStart; k < groupEnd && keysRemaining > 0; k++) {
 
-            Record singleRec = getRecord(inputFile);
+                        int pos = get<2>(keysByBucket[k]);
+                        if (results[pos].has_value())
+                            continue;
 
-            // Debug
-            // singleRec.print();
+                        uint32_t tag = keyTag(ids[pos]);
+                        for (int slot = currPage.findTag(tag); slot < currPage.numRecords(); slot = currPage.findTag(tag, slot + 1)) {
 
-            // Check if there are no more records to read
-            // and end loop, otherwise insert into index
-            if (singleRec.id == -1) {
+                            const char *recordData = currPage.recordData(slot);
+                            if (!Codec::matches(recordData, ids[pos]))
+                                continue;
 
-                cout << "All records read!" << endl;
-                recordsRemaining = false;
+                            int recordLength = currPage.slotLength(slot);
+                            const char *record = resolveRecord(recordData, recordLength, buffer);
+                            results[pos] = Serializer::read(record, recordLength);
+                            keysRemaining--;
+                            break;
 
-            }
-            else {
+                        }
 
-                insertRecord(singleRec, indexFile);
+                    }
+
+                    int nextPgIdx = currPage.overflowPtr();
+                    bufferPool.unpinPage(pgIdx, false);
+                    pgIdx = nextPgIdx;
+
+                }
+
+                latch.unlockShared();
+                groupStart = groupEnd;
 
             }
 
         }
 
-        // Print out stats for validation of results
-        cout << "\n\n" << "----------------------------------------------------------------------------" << endl;
-        cout << "[FINAL STATS]" << endl;
-        cout << "# of buckets: " << numBuckets << endl;
-        cout << "# of blocks: " << numBlocks << endl;
-        cout << "# of overflow blocks: " << numOverflowBlocks << endl;
-        cout << "# of records: " << numRecords << endl;
-        cout << "Average capacity per bucket (decimal percentage): " << (double)currentTotalSize / (numBuckets * PAGE_SIZE) << endl;
-        cout << "----------------------------------------------------------------------------" << endl;
-
-        // Close filestreams
-        indexFile.close();
-        inputFile.close();
+        return results;
 
     }
 
-    // Given an ID, find the relevant record and print it
-    Record findRecordById(int id) {
+    // Every record of the index that passes a predicate, handed out one at a time (see scan())
+    // The cursor holds off splits and merges until it is destroyed (see structureMutex)
+    class ScanCursor {
+    private:
+        LinearHashIndex *index;
+        function<bool(const View &)> predicate;
+        shared_lock<shared_mutex> structureLock;
+        int nextBucket;
+        int endBucket;
+
+        // Records of the last batch of buckets that passed the predicate
+        vector<Rec> batch;
+        size_t batchPos;
+
+    public:
+        ScanCursor(LinearHashIndex &owner, function<bool(const View &)> filter)
+            : index(&owner), predicate(std::move(filter)), structureLock(owner.structureMutex),
+              nextBucket(0), endBucket(owner.numBuckets), batchPos(0) {
+            if (!predicate)
+                predicate = [](const View &) { return true; };
+        }
 
-        // Open file
-        fstream indexFile(fName, ios::in);
-        
-        // Calculate bucket index and get last i'th bits
-        // since we insert before we search, we can assume that the member variable i
-        // is already the right value to address all buckets and so we can reuse it here
-        // for calculating the bucket index of the target id
-        int bucketIdx = getLastIthBits(hash(id), i);
+        // Next record, std::nullopt once every bucket has been scanned
+        optional<Rec> next() {
+
+            while (batchPos == batch.size()) {
+
+                if (nextBucket == endBucket)
+                    return nullopt;
+
+                int batchEnd = min(endBucket, nextBucket + SCAN_BATCH_BUCKETS);
+                batch.clear();
+                batchPos = 0;
+
+                auto keep = [this](const char *recordData, int recordLength) {
+                    batch.push_back(Serializer::read(recordData, recordLength));
+                };
+                index->scanBuckets(nextBucket, batchEnd, predicate, keep);
+                nextBucket = batchEnd;
+
+            }
+
+            return std::move(batch[batchPos++]);
 
-        // Check if the record is going to be in real or fake/ghost bucket
-        // If value of last i'th bits >= n, then set MSB from 1 to 0
-        // Deals with virtual/ghost buckets
-        if (bucketIdx >= numBuckets) {
-            cout << "[SEARCH] Set bucket index MSB to 0, # of buckets is: " << numBuckets << endl;
-            bucketIdx &= ~(1 << (i-1));
         }
+    };
+
+    // Cursor over every record of the index that predicate (called with a Serializer::View of the record
+    // in its page, e.g. an EmployeeFilter) accepts, all records if it is empty. Buckets are read a batch at a
+    // time with read-ahead (see scanBuckets()), only records that pass the predicate are copied out.
+    // Records are in no particular order. Lookups and writes can go on while the cursor is open: every record
+    // in the index for the whole scan is returned once, records inserted or deleted during it may or may not be
+    ScanCursor scan(function<bool(const View &)> predicate = nullptr) {
+        return ScanCursor(*this, std::move(predicate));
+    }
 
-        // Iterate through block by block of the bucket (base + overflow blocks)
-        // until record with id is found
+    // Scan on numThreads threads (all cores by default), calling onRecord(view) for every record predicate
+    // accepts. Threads take batches of buckets off a shared counter, so the bucket range is spread over them
+    // however long each chain takes. onRecord is called from several threads at once, with a view that is only
+    // valid during the call, and must not write to the index. Same guarantees as scan() for concurrent writes
+    template <class Predicate, class Callback>
+    void parallelScan(Predicate predicate, Callback onRecord, int numThreads = 0) {
 
-        // Get page index
-        int pgIdx = pageDirectory[bucketIdx];
+        if (numThreads <= 0)
+            numThreads = max(1u, thread::hardware_concurrency());
 
-        while (pgIdx != -1) {
-            
-            // Read block
-            // NOTE: MEETS 3 BLOCKS IN MAIN MEMORY REQUIREMENT
-            // WE READ ONE BLOCK AT A TIME AND THEN MOVE TO NEXT BLOCK
-            Block currBlock(pgIdx);
-            currBlock.readBlock(indexFile);
+        shared_lock<shared_mutex> structureLock(structureMutex);
 
-            // Check if record with target ID in block
-            for (int i = 0; i < currBlock.numRecords; i++) {
+        int endBucket = numBuckets;
+        atomic<int> nextBucket(0);
+
+        runOnThreads(numThreads, [&](int) {
+
+            Predicate threadPredicate = predicate;
+            auto forward = [&onRecord](const char *recordData, int recordLength) {
+                onRecord(Serializer::view(recordData, recordLength));
+            };
+
+            int firstBucket;
+            while ((firstBucket = nextBucket.fetch_add(SCAN_BATCH_BUCKETS)) < endBucket)
+                scanBuckets(firstBucket, min(endBucket, firstBucket + SCAN_BATCH_BUCKETS), threadPredicate, forward);
 
-                // Return record if found
-                if(currBlock.records[i].id == id)
-                    return currBlock.records[i];
+        });
+
+    }
+
+    // Records with one secondary key, handed out one at a time (see findBySecondaryKey())
+    class SecondaryCursor {
+    private:
+        LinearHashIndex *index;
+        SecondaryKey secondaryKey;
+        vector<Key> primaryKeys;
+        size_t nextPos;
+
+    public:
+        SecondaryCursor(LinearHashIndex &owner, const SecondaryKey &key, vector<Key> matchingPrimaryKeys)
+            : index(&owner), secondaryKey(key), primaryKeys(std::move(matchingPrimaryKeys)), nextPos(0) {}
+
+        // Number of entries the secondary index had for the key when the cursor was made
+        size_t size() const {
+            return primaryKeys.size();
+        }
+
+        // Look up the next record, std::nullopt once there are none left
+        // Records deleted (or updated to another secondary key) since the cursor was made are skipped
+        optional<Rec> next() {
+
+            while (nextPos < primaryKeys.size()) {
+
+                optional<Rec> found;
+                index->probeEncoded(primaryKeys[nextPos++], [this, &found](const char *recordData, int recordLength) {
+                    if (Serializer::secondaryKey(Serializer::view(recordData, recordLength)) == secondaryKey)
+                        found = Serializer::read(recordData, recordLength);
+                });
+
+                if (found)
+                    return found;
 
             }
 
-            // Move up pgIdx to overflow block for next iteration
-            pgIdx = currBlock.overflowPtrIdx;
+            return nullopt;
 
         }
+    };
+
+    // Find the records with a secondary key through the secondary index (IndexOptions::secondaryIndex) instead
+    // of scanning every bucket. The key's bucket of the secondary index is probed once for the primary keys of
+    // all matches, and the records themselves are only looked up one by one as the cursor gets to them
+    // Safe to call while another thread writes, like findRecordById()
+    SecondaryCursor findBySecondaryKey(const SecondaryKey &secondaryKey) requires HasSecondaryKey<Serializer> {
+
+        if (!secondary)
+            throw runtime_error("Index was made without a secondary index (see IndexOptions::secondaryIndex)");
+
+        vector<Key> primaryKeys;
+        secondary->probeAllEncoded(secondaryKey, [&primaryKeys](const char *entryData, int entryLength) {
+            primaryKeys.push_back(SecondaryEntrySerializer<SecondaryKey, Key>::read(entryData, entryLength).primaryKey);
+        });
 
-        indexFile.close();
+        return SecondaryCursor(*this, secondaryKey, std::move(primaryKeys));
 
     }
+
+    // Direct reports of a manager: every employee whose manager_id is managerId
+    SecondaryCursor findByManagerId(int managerId) requires is_same_v<Serializer, EmployeeSerializer> {
+        return findBySecondaryKey(managerId);
+    }
 };
+
+// The Employee index (Record keyed by its int id), with the hash function as the only choice left
+template <class HashPolicy = Murmur3Hash>
+using EmployeeIndex = LinearHashIndex<int, Record, EmployeeSerializer, HashPolicy>;
+
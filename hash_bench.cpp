@@ -0,0 +1,125 @@
+/*
+Compares the hash functions the index can be built with (see HashPolicy in classes.h)
+on a few key patterns, reporting how long the bucket chains get and how fast lookups are.
+
+Build and run:
+    g++ -std=c++20 -O2 -pthread -o hash_bench hash_bench.cpp
+    ./hash_bench [# of keys]
+*/
+
+#include <chrono>
+#include <random>
+#include "classes.h"
+using namespace std;
+
+// Key patterns, all around the ids of Employee.csv (sequential 8 digit ids starting at 11432112)
+vector<int> makeKeys(const string &pattern, int numKeys) {
+
+    const int FIRST_ID = 11432112;
+    vector<int> keys;
+    mt19937 rng(440);
+
+    for (int k = 0; k < numKeys; k++) {
+        if (pattern == "sequential")
+            keys.push_back(FIRST_ID + k);
+        else if (pattern == "random")
+            keys.push_back(10000000 + rng() % 90000000);
+        else if (pattern == "clustered")
+            keys.push_back(FIRST_ID + (k / 100) * 10000 + k % 100);     // runs of 100 ids, 10000 apart
+        else
+            keys.push_back(FIRST_ID + (k % 32000) * 65536 + k / 32000); // "stride": (almost) same id mod 2^16
+    }
+
+    // Random ids may repeat, the index expects unique ids
+    sort(keys.begin(), keys.end());
+    keys.erase(unique(keys.begin(), keys.end()), keys.end());
+    shuffle(keys.begin(), keys.end(), rng);
+
+    return keys;
+
+}
+
+// Keeps the compiler from dropping the timed hash loop
+volatile uint64_t hashSink;
+
+// Employee.csv like rows: short name, ~480 character bio
+void writeCsv(const string &csvFName, const vector<int> &keys) {
+
+    ofstream csv(csvFName, ios::out | ios::trunc);
+    string bio(480, 'x');
+
+    for (int key : keys)
+        csv << key << ",Employee " << key % 1000 << "," << bio << "," << keys[0] << "\n";
+
+}
+
+template <class HashPolicy>
+void runHash(const string &pattern, const string &csvFName, const vector<int> &keys) {
+
+    // Time the hash function on its own
+    auto start = chrono::steady_clock::now();
+    uint64_t sink = 0;
+    for (int round = 0; round < 10; round++) {
+        for (int key : keys)
+            sink += HashPolicy::hash((uint64_t)(int64_t)key);
+    }
+    double hashNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / (10.0 * keys.size());
+    hashSink = sink;
+
+    EmployeeIndex<HashPolicy> index("hash_bench.idx");
+
+    index.parallelBulkLoadFromFile(csvFName);
+    vector<int> lengths = index.chainLengths();
+
+    // Probe a sample of keys (a whole run would take ages on the degenerate chains)
+    int numProbes = min((int)keys.size(), 20000);
+    int numFound = 0;
+    start = chrono::steady_clock::now();
+    for (int k = 0; k < numProbes; k++)
+        numFound += index.probeRecord(keys[k], [](const RecordView &) {});
+    double probeNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / numProbes;
+
+    // Chain length histogram: 1, 2, 3, 4 and more blocks
+    int histogram[4] = {0, 0, 0, 0};
+    long long totalBlocks = 0;
+    for (int length : lengths) {
+        histogram[min(length, 4) - 1]++;
+        totalBlocks += length;
+    }
+
+    cout << pattern << "\t" << HashPolicy::NAME
+         << "\tbuckets " << lengths.size()
+         << "\tmax chain " << *max_element(lengths.begin(), lengths.end())
+         << "\tavg chain " << (double)totalBlocks / lengths.size()
+         << "\tchains 1/2/3/4+ " << histogram[0] << "/" << histogram[1] << "/" << histogram[2] << "/" << histogram[3]
+         << "\thash " << hashNs << " ns"
+         << "\tprobe " << probeNs << " ns"
+         << (numFound == numProbes ? "" : "\tMISSING KEYS") << endl;
+
+}
+
+int main(int argc, char* const argv[]) {
+
+    int numKeys = (argc > 1) ? atoi(argv[1]) : 100000;
+
+    // Keep the build stats the index logs out of the report
+    setLogLevel(LOG_WARN);
+
+    for (string pattern : {"sequential", "random", "clustered", "stride"}) {
+
+        vector<int> keys = makeKeys(pattern, numKeys);
+        writeCsv("hash_bench.csv", keys);
+
+        runHash<ModuloHash>(pattern, "hash_bench.csv", keys);
+        runHash<Murmur3Hash>(pattern, "hash_bench.csv", keys);
+        runHash<WyHash>(pattern, "hash_bench.csv", keys);
+        runHash<Xxh3Hash>(pattern, "hash_bench.csv", keys);
+
+    }
+
+    remove("hash_bench.csv");
+    remove("hash_bench.idx");
+
+    return 0;
+
+}
@@ -0,0 +1,420 @@
+/*
+Build and lookup benchmark of the index on synthetic Employee.csv like data.
+For every row count it generates a csv, builds the index from it and looks ids up, reporting
+build throughput, findRecordById hit and miss latency and how much bigger the index file is than
+the records in it. Results are written as JSON so runs can be compared to catch regressions.
+
+Build and run (see CMakeLists.txt):
+    cmake -S . -B build && cmake --build build
+    ./build/index_bench --rows 1000,100000 --keys zipfian --out results.json
+
+Options:
+    --rows N[,N...]         row counts to run (default 1000,10000,100000), anything from 10^3 to 10^8
+    --bio MIN-MAX           bio length range in characters, uniformly distributed (default 400-500)
+    --keys PATTERN          sequential: ids FIRST_ID, FIRST_ID + 1, ... looked up in id order
+                            uniform:    ids scattered over the whole int range, looked up uniformly
+                            zipfian:    scattered ids, looked up with a zipfian skew (a few hot ids)
+    --lookups N             lookups per run for hits and for misses each (default 100000)
+    --loader NAME           create (createFromFile, the default), bulk or parallel
+    --mmap                  use the mmap backend
+    --frames N              buffer pool frames (default 64)
+    --page-size BYTES       index page size (default 4096)
+    --split POLICY          utilization (default), overflow or chain
+    --split-threshold F     average bucket fill that triggers a split with --split utilization (default 0.7)
+    --max-chain K           chain length that triggers a split with --split chain (default 2)
+    --compress              store bios compressed
+    --separate-payloads     keep only ids in the bucket pages and the records in a heap file next to the index
+    --dir PATH              where the csv and index files go (default .)
+    --out FILE              JSON results (default index_bench.json)
+    --keep                  keep the generated csv and index files
+*/
+
+#include <chrono>
+#include <random>
+#include "classes.h"
+using namespace std;
+
+const int FIRST_ID = 11432112;
+
+// Indexed by SplitPolicy
+const char *const SPLIT_POLICY_NAMES[] = {"utilization", "overflow", "chain"};
+
+// Distinct ids for row k. Uniform ids come from k * A + B mod a prime (a bijection on [0, P)), so
+// they are spread over the whole positive int range without remembering which ones were handed out.
+// Ids for k >= number of rows are never in the data set, which is where misses come from.
+int makeId(const string &keyPattern, long long k) {
+
+    const uint64_t PRIME = 2147483647;      // 2^31 - 1
+    const uint64_t A = 1103515245;
+    const uint64_t B = 12345;
+
+    if (keyPattern == "sequential")
+        return FIRST_ID + (int)k;
+
+    return (int)(((uint64_t)k * A + B) % PRIME) + 1;
+
+}
+
+// Zipfian ranks in [0, n) (Gray et al., "Quickly generating billion-record synthetic databases"),
+// the generator YCSB uses. Rank 0 is the most popular.
+class ZipfianGenerator {
+private:
+    long long n;
+    double theta, alpha, zetaN, eta;
+
+    static double zeta(long long count, double theta) {
+        double sum = 0;
+        for (long long k = 1; k <= count; k++)
+            sum += 1.0 / pow((double)k, theta);
+        return sum;
+    }
+
+public:
+    ZipfianGenerator(long long numItems, double zipfTheta = 0.99) : n(numItems), theta(zipfTheta) {
+        zetaN = zeta(n, theta);
+        alpha = 1.0 / (1.0 - theta);
+        eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta(2, theta) / zetaN);
+    }
+
+    long long next(mt19937_64 &rng) {
+
+        double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+        double uz = u * zetaN;
+
+        if (uz < 1.0)
+            return 0;
+        if (uz < 1.0 + pow(0.5, theta))
+            return 1;
+
+        return min(n - 1, (long long)(n * pow(eta * u - eta + 1.0, alpha)));
+
+    }
+};
+
+struct BenchConfig {
+    vector<long long> rowCounts = {1000, 10000, 100000};
+    int bioMin = 400;
+    int bioMax = 500;
+    string keyPattern = "uniform";
+    int numLookups = 100000;
+    string loader = "create";
+    IndexOptions options;
+    string dir = ".";
+    string outFName = "index_bench.json";
+    bool keepFiles = false;
+};
+
+// Write numRows Employee rows (id, name, bio, manager id) to csvFName
+// Returns the number of bytes the encoded records take up (what the index has to store at the least)
+long long writeCsv(const BenchConfig &config, long long numRows, const string &csvFName) {
+
+    // Bios are slices of a long run of words, no commas or quotes so every row is 4 plain fields
+    static const string WORDS = "lorem ipsum dolor sit amet consectetur adipiscing elit sed do eiusmod tempor "
+                                "incididunt ut labore et dolore magna aliqua ut enim ad minim veniam quis nostrud ";
+    string text;
+    while ((int)text.size() < 2 * config.bioMax + (int)WORDS.size())
+        text += WORDS;
+
+    mt19937_64 rng(440);
+    uniform_int_distribution<int> bioLength(config.bioMin, config.bioMax);
+    uniform_int_distribution<int> bioStart(0, text.size() - config.bioMax - 1);
+
+    ofstream csv(csvFName, ios::out | ios::trunc | ios::binary);
+    string row;
+    long long recordBytes = 0;
+
+    for (long long k = 0; k < numRows; k++) {
+
+        string name = "Employee " + to_string(k);
+        int length = bioLength(rng);
+
+        row.clear();
+        row += to_string(makeId(config.keyPattern, k));
+        row += ',';
+        row += name;
+        row += ',';
+        row.append(text, bioStart(rng), length);
+        row += ',';
+        row += to_string(makeId(config.keyPattern, k / 10));
+        row += '\n';
+        csv.write(row.data(), row.size());
+
+        recordBytes += Record(0, name, string(length, ' '), 0).calcSize();
+
+    }
+
+    return recordBytes;
+
+}
+
+long long fileSize(const string &fName) {
+    struct stat fileStat;
+    return stat(fName.c_str(), &fileStat) == 0 ? fileStat.st_size : 0;
+}
+
+string latencyJson(const LatencySummary &latency) {
+    ostringstream json;
+    json << "{\"count\": " << latency.count << ", \"mean\": " << latency.mean << ", \"p50\": " << latency.p50
+         << ", \"p90\": " << latency.p90 << ", \"p99\": " << latency.p99 << ", \"p999\": " << latency.p999
+         << ", \"max\": " << latency.max << "}";
+    return json.str();
+}
+
+// Time numLookups findRecordById() calls, the k-th row's id for every k nextRow() hands out
+// Returns the number of ids that were found
+template <class NextRow>
+long long timeLookups(EmployeeIndex<> &index, const BenchConfig &config, int numLookups, NextRow &&nextRow,
+                      LatencyHistogram &latencies) {
+
+    long long numFound = 0;
+
+    for (int lookup = 0; lookup < numLookups; lookup++) {
+
+        int id = makeId(config.keyPattern, nextRow());
+
+        auto start = chrono::steady_clock::now();
+        Record found = index.findRecordById(id);
+        latencies.record(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+
+        numFound += (found.id == id);
+
+    }
+
+    return numFound;
+
+}
+
+// Generate, build and look up one data set, returns its JSON results
+string runBench(const BenchConfig &config, long long numRows) {
+
+    string csvFName = config.dir + "/index_bench_" + to_string(numRows) + ".csv";
+    string idxFName = config.dir + "/index_bench_" + to_string(numRows) + ".idx";
+
+    cout << "rows " << numRows << ": generating" << flush;
+    long long recordBytes = writeCsv(config, numRows, csvFName);
+    long long csvBytes = fileSize(csvFName);
+
+    EmployeeIndex<> index(idxFName, config.options);
+
+    // Build
+    cout << ", building" << flush;
+    auto start = chrono::steady_clock::now();
+    if (config.loader == "parallel")
+        index.parallelBulkLoadFromFile(csvFName);
+    else if (config.loader == "bulk")
+        index.bulkLoadFromFile(csvFName);
+    else
+        index.createFromFile(csvFName);
+    double buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    // Counted from the pages in use (and the heap), not the file sizes, so a backend that keeps
+    // slack past the last page can't make the index look bigger than it is
+    IndexMetrics buildMetrics = index.metrics();
+    long long indexBytes = (long long)buildMetrics.shape.numPages * buildMetrics.shape.pageSize + buildMetrics.heapBytes;
+    index.resetMetrics();
+
+    // Lookups of ids that are in the data set (hits) and ids that aren't (misses)
+    cout << ", looking up" << flush;
+    mt19937_64 rng(4400);
+    long long nextSequential = 0;
+    uniform_int_distribution<long long> uniformRow(0, numRows - 1);
+    unique_ptr<ZipfianGenerator> zipfian;
+    if (config.keyPattern == "zipfian")
+        zipfian.reset(new ZipfianGenerator(numRows));
+
+    auto nextHit = [&]() -> long long {
+        if (config.keyPattern == "sequential")
+            return nextSequential++ % numRows;
+        if (zipfian)
+            // Scatter the popular ranks over the rows, otherwise the hot ids would all be the first rows
+            return (long long)(Murmur3Hash::hash(zipfian->next(rng)) % numRows);
+        return uniformRow(rng);
+    };
+    auto nextMiss = [&]() -> long long {
+        return numRows + uniformRow(rng);
+    };
+
+    LatencyHistogram hitLatency;
+    LatencyHistogram missLatency;
+
+    start = chrono::steady_clock::now();
+    long long hitsFound = timeLookups(index, config, config.numLookups, nextHit, hitLatency);
+    long long missesFound = timeLookups(index, config, config.numLookups, nextMiss, missLatency);
+    double lookupSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    IndexMetrics lookupMetrics = index.metrics();
+
+    // Full scans, with the cursor and on all cores
+    cout << ", scanning" << flush;
+    start = chrono::steady_clock::now();
+    long long scanned = 0;
+    {
+        auto cursor = index.scan();
+        while (cursor.next())
+            scanned++;
+    }
+    double scanSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    start = chrono::steady_clock::now();
+    atomic<long long> parallelScanned(0);
+    index.parallelScan(EmployeeFilter(), [&parallelScanned](const RecordView &) {
+        parallelScanned.fetch_add(1, memory_order_relaxed);
+    });
+    double parallelScanSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    LatencySummary hits = hitLatency.summary();
+    LatencySummary misses = missLatency.summary();
+    double amplification = (double)indexBytes / recordBytes;
+
+    cout << "\n\tbuild " << buildSeconds << " s (" << numRows / buildSeconds << " rows/s, "
+         << csvBytes / buildSeconds / (1 << 20) << " MB/s of csv)"
+         << "\n\thit p50/p99 " << hits.p50 << "/" << hits.p99 << " ns, miss p50/p99 " << misses.p50 << "/" << misses.p99 << " ns"
+         << "\n\tscan " << scanSeconds << " s, parallel scan " << parallelScanSeconds << " s"
+         << "\n\tindex " << indexBytes << " bytes, " << amplification << "x the records" << endl;
+
+    if (scanned != numRows || parallelScanned != numRows)
+        cout << "\tWRONG RESULTS: scans found " << scanned << " and " << parallelScanned << " of " << numRows << " rows" << endl;
+
+    if (hitsFound != config.numLookups || missesFound != 0)
+        cout << "\tWRONG RESULTS: " << hitsFound << " of " << config.numLookups << " hits found, "
+             << missesFound << " misses found" << endl;
+
+    ostringstream json;
+    json << "    {\n";
+    json << "      \"rows\": " << numRows << ",\n";
+    json << "      \"keys\": \"" << config.keyPattern << "\",\n";
+    json << "      \"bioMin\": " << config.bioMin << ",\n";
+    json << "      \"bioMax\": " << config.bioMax << ",\n";
+    json << "      \"loader\": \"" << config.loader << "\",\n";
+    json << "      \"backend\": \"" << (config.options.backend == MMAP_BACKEND ? "mmap" : "stream") << "\",\n";
+    json << "      \"frames\": " << config.options.numFrames << ",\n";
+    json << "      \"pageSize\": " << config.options.pageSize << ",\n";
+    json << "      \"splitPolicy\": \"" << SPLIT_POLICY_NAMES[config.options.splitPolicy] << "\",\n";
+    json << "      \"splitThreshold\": " << config.options.splitThreshold << ",\n";
+    json << "      \"maxChainLength\": " << config.options.maxChainLength << ",\n";
+    json << "      \"compressRecords\": " << (config.options.compressRecords ? "true" : "false") << ",\n";
+    json << "      \"separatePayloads\": " << (config.options.separatePayloads ? "true" : "false") << ",\n";
+    json << "      \"csvBytes\": " << csvBytes << ",\n";
+    json << "      \"recordBytes\": " << recordBytes << ",\n";
+    json << "      \"indexBytes\": " << indexBytes << ",\n";
+    json << "      \"sizeAmplification\": " << amplification << ",\n";
+    json << "      \"buildSeconds\": " << buildSeconds << ",\n";
+    json << "      \"buildRowsPerSecond\": " << numRows / buildSeconds << ",\n";
+    json << "      \"buildCsvBytesPerSecond\": " << csvBytes / buildSeconds << ",\n";
+    json << "      \"lookupSeconds\": " << lookupSeconds << ",\n";
+    json << "      \"hitLatencyNs\": " << latencyJson(hits) << ",\n";
+    json << "      \"missLatencyNs\": " << latencyJson(misses) << ",\n";
+    json << "      \"hitsFound\": " << hitsFound << ",\n";
+    json << "      \"missesFound\": " << missesFound << ",\n";
+    json << "      \"scanSeconds\": " << scanSeconds << ",\n";
+    json << "      \"parallelScanSeconds\": " << parallelScanSeconds << ",\n";
+    json << "      \"scannedRows\": " << scanned << ",\n";
+    json << "      \"buildMetrics\": " << buildMetrics.toJson() << ",\n";
+    json << "      \"lookupMetrics\": " << lookupMetrics.toJson() << "\n";
+    json << "    }";
+
+    if (!config.keepFiles) {
+        remove(csvFName.c_str());
+        remove(idxFName.c_str());
+        remove((idxFName + ".heap").c_str());
+    }
+
+    return json.str();
+
+}
+
+int main(int argc, char* const argv[]) {
+
+    BenchConfig config;
+
+    for (int arg = 1; arg < argc; arg++) {
+
+        string flag = argv[arg];
+        bool hasValue = arg + 1 < argc;
+
+        if (flag == "--rows" && hasValue) {
+            config.rowCounts.clear();
+            stringstream counts(argv[++arg]);
+            string count;
+            while (getline(counts, count, ','))
+                config.rowCounts.push_back(stoll(count));
+        }
+        else if (flag == "--bio" && hasValue) {
+            string range = argv[++arg];
+            size_t dash = range.find('-');
+            config.bioMin = stoi(range.substr(0, dash));
+            config.bioMax = (dash == string::npos) ? config.bioMin : stoi(range.substr(dash + 1));
+        }
+        else if (flag == "--keys" && hasValue)
+            config.keyPattern = argv[++arg];
+        else if (flag == "--lookups" && hasValue)
+            config.numLookups = stoi(argv[++arg]);
+        else if (flag == "--loader" && hasValue)
+            config.loader = argv[++arg];
+        else if (flag == "--mmap")
+            config.options.backend = MMAP_BACKEND;
+        else if (flag == "--frames" && hasValue)
+            config.options.numFrames = stoi(argv[++arg]);
+        else if (flag == "--page-size" && hasValue)
+            config.options.pageSize = stoi(argv[++arg]);
+        else if (flag == "--split" && hasValue) {
+            string policy = argv[++arg];
+            if (policy == "overflow")
+                config.options.splitPolicy = SPLIT_ON_OVERFLOW;
+            else if (policy == "chain")
+                config.options.splitPolicy = SPLIT_ON_CHAIN_LENGTH;
+            else if (policy == "utilization")
+                config.options.splitPolicy = SPLIT_ON_UTILIZATION;
+            else {
+                cerr << "--split has to be utilization, overflow or chain" << endl;
+                return 1;
+            }
+        }
+        else if (flag == "--split-threshold" && hasValue)
+            config.options.splitThreshold = stod(argv[++arg]);
+        else if (flag == "--max-chain" && hasValue)
+            config.options.maxChainLength = stoi(argv[++arg]);
+        else if (flag == "--compress")
+            config.options.compressRecords = true;
+        else if (flag == "--separate-payloads")
+            config.options.separatePayloads = true;
+        else if (flag == "--dir" && hasValue)
+            config.dir = argv[++arg];
+        else if (flag == "--out" && hasValue)
+            config.outFName = argv[++arg];
+        else if (flag == "--keep")
+            config.keepFiles = true;
+        else {
+            cerr << "Unknown option " << flag << " (see the top of index_bench.cpp)" << endl;
+            return 1;
+        }
+
+    }
+
+    if (config.keyPattern != "sequential" && config.keyPattern != "uniform" && config.keyPattern != "zipfian") {
+        cerr << "--keys has to be sequential, uniform or zipfian" << endl;
+        return 1;
+    }
+    if (config.bioMin < 0 || config.bioMax < config.bioMin) {
+        cerr << "--bio has to be a range MIN-MAX with 0 <= MIN <= MAX" << endl;
+        return 1;
+    }
+
+    // Keep the build stats the index logs out of the report
+    setLogLevel(LOG_WARN);
+
+    vector<string> runs;
+    for (long long numRows : config.rowCounts)
+        runs.push_back(runBench(config, numRows));
+
+    ofstream out(config.outFName, ios::out | ios::trunc);
+    out << "{\n  \"runs\": [\n";
+    for (size_t run = 0; run < runs.size(); run++)
+        out << runs[run] << (run + 1 < runs.size() ? ",\n" : "\n");
+    out << "  ]\n}\n";
+
+    cout << "Results written to " << config.outFName << endl;
+
+    return 0;
+
+}
@@ -16,9 +16,77 @@ using namespace std;
 
 int main(int argc, char* const argv[]) {
 
-    // Create the index
-    LinearHashIndex emp_index("EmployeeIndex");
-    emp_index.createFromFile("Employee.csv");
+    // Command line flags:
+    // --rebuild    always recreate the index from the csv file
+    // --mmap       access the index file through mmap instead of fstream
+    // --bulk       build the index with the bulk loader instead of record by record
+    // --parallel   build the index with the multithreaded bulk loader
+    // --compact    truncate free pages off the end of the index file before searching
+    // --wal        log changes to a write-ahead log so the index survives a crash
+    // --verbose    trace every insert, split and merge (compiled out of -DNDEBUG builds)
+    // --metrics    print the index metrics as JSON before searching
+    // --reports    keep a secondary index on manager_id and list the direct reports of every record found
+    // --compress   store bios compressed (only applies when the index is rebuilt)
+    // --separate   keep only ids in the bucket pages and the records in <index file>.heap
+    bool forceRebuild = false;
+    bool bulkLoad = false;
+    bool parallelLoad = false;
+    bool compactIndex = false;
+    bool printMetrics = false;
+    bool listReports = false;
+    IndexOptions options;
+
+    for (int arg = 1; arg < argc; arg++) {
+        if (string(argv[arg]) == "--rebuild")
+            forceRebuild = true;
+        else if (string(argv[arg]) == "--mmap")
+            options.backend = MMAP_BACKEND;
+        else if (string(argv[arg]) == "--bulk")
+            bulkLoad = true;
+        else if (string(argv[arg]) == "--parallel")
+            parallelLoad = true;
+        else if (string(argv[arg]) == "--compact")
+            compactIndex = true;
+        else if (string(argv[arg]) == "--wal")
+            options.writeAheadLog = true;
+        else if (string(argv[arg]) == "--verbose")
+            setLogLevel(LOG_TRACE);
+        else if (string(argv[arg]) == "--metrics")
+            printMetrics = true;
+        else if (string(argv[arg]) == "--reports") {
+            options.secondaryIndex = true;
+            listReports = true;
+        }
+        else if (string(argv[arg]) == "--compress")
+            options.compressRecords = true;
+        else if (string(argv[arg]) == "--separate")
+            options.separatePayloads = true;
+    }
+
+    // The mmap backend writes pages straight to the file, so there is no keeping uncommitted ones out of it
+    if (options.writeAheadLog && options.backend == MMAP_BACKEND) {
+        cerr << "Error: --wal can't be combined with --mmap\n";
+        return 1;
+    }
+
+    // Reuse the index file from a previous run if there is one, otherwise
+    // create the index from the csv file
+    EmployeeIndex<> emp_index("EmployeeIndex", options);
+
+    if (forceRebuild || !emp_index.open()) {
+        if (parallelLoad)
+            emp_index.parallelBulkLoadFromFile("Employee.csv");
+        else if (bulkLoad)
+            emp_index.bulkLoadFromFile("Employee.csv");
+        else
+            emp_index.createFromFile("Employee.csv");
+    }
+
+    if (compactIndex)
+        emp_index.compact();
+
+    if (printMetrics)
+        cout << emp_index.metrics().toJson() << endl;
     
     // Loop to lookup IDs until user is ready to quit
     // ASSUMES USER INPUT IS MOSTLY CORRECT (I.E USER
@@ -55,7 +123,21 @@ int main(int argc, char* const argv[]) {
             Record targetRecord = emp_index.findRecordById(user_input);
 
             // Print record
-            targetRecord.print();
+            if (targetRecord.id == -1)
+                cout << "No record with ID " << user_input << " in index\n";
+            else {
+
+                targetRecord.print();
+
+                if (listReports) {
+                    auto reports = emp_index.findByManagerId(targetRecord.id);
+                    cout << "\tDIRECT REPORTS:";
+                    while (optional<Record> report = reports.next())
+                        cout << " " << report->id << " (" << report->name << ")";
+                    cout << "\n";
+                }
+
+            }
 
         }
         else
@@ -0,0 +1,164 @@
+/*
+Concurrency stress test: one thread inserts records while reader threads look ids up with findRecordById().
+The writer publishes how many records it has inserted after each insertRecord() returns. Lookups have to be
+linearizable against the inserts, so every reader checks that
+  - an id published before its lookup started is found, with the record that was inserted for it
+  - an id that is never inserted is never found
+Exits with 1 on the first violation. The inserts go through many splits, so readers race directory changes too.
+
+Build and run (see CMakeLists.txt, ctest runs it):
+    cmake -S . -B build && cmake --build build
+    ./build/stress_test --records 50000 --readers 4
+
+Options:
+    --records N         records the writer inserts (default 50000)
+    --readers N         reader threads (default 4)
+    --mmap              use the mmap backend
+    --page-size BYTES   index page size (default 4096)
+    --frames N          buffer pool frames (default 64)
+    --dir PATH          where the index files go (default .)
+*/
+
+#include <atomic>
+#include <random>
+#include <thread>
+#include "classes.h"
+using namespace std;
+
+const int FIRST_ID = 1000;
+
+// Records are a function of their id, so readers can check what they got back without sharing state.
+// Bio lengths vary so blocks fill unevenly and chains grow before they split
+Record makeRecord(int id) {
+    return Record(id, "Employee " + to_string(id), string(100 + (id * 7919) % 300, 'a' + id % 26), id / 10);
+}
+
+bool sameRecord(const Record &found, const Record &expected) {
+    return found.id == expected.id && found.name == expected.name && found.bio == expected.bio &&
+           found.manager_id == expected.manager_id;
+}
+
+int main(int argc, char* const argv[]) {
+
+    int numRecords = 50000;
+    int numReaders = 4;
+    string dir = ".";
+    IndexOptions options;
+
+    for (int arg = 1; arg < argc; arg++) {
+
+        string flag = argv[arg];
+        bool hasValue = arg + 1 < argc;
+
+        if (flag == "--records" && hasValue)
+            numRecords = stoi(argv[++arg]);
+        else if (flag == "--readers" && hasValue)
+            numReaders = stoi(argv[++arg]);
+        else if (flag == "--mmap")
+            options.backend = MMAP_BACKEND;
+        else if (flag == "--page-size" && hasValue)
+            options.pageSize = stoi(argv[++arg]);
+        else if (flag == "--frames" && hasValue)
+            options.numFrames = stoi(argv[++arg]);
+        else if (flag == "--dir" && hasValue)
+            dir = argv[++arg];
+        else {
+            cerr << "Unknown option " << flag << "\n";
+            return 2;
+        }
+
+    }
+
+    // Files are named after the backend so runs can go in parallel
+    string indexFName = dir + (options.backend == MMAP_BACKEND ? "/stress_test_mmap.idx" : "/stress_test_stream.idx");
+
+    atomic<int> published(0);
+    atomic<bool> writerDone(false);
+    atomic<bool> failed(false);
+    atomic<long long> numLookups(0);
+
+    {
+        // Starts out empty, the first insert creates the index file
+        EmployeeIndex<> index(indexFName, options);
+
+        auto reader = [&](int readerIdx) {
+
+            mt19937 rng(readerIdx);
+            long long lookups = 0;
+
+            while (!failed) {
+
+                // Read the count before the lookup starts: those inserts all finished before it
+                bool lastRound = writerDone;
+                int visible = published;
+
+                int expectPresent = visible == 0 ? -1 : FIRST_ID + (int)(rng() % visible);
+                if (expectPresent != -1) {
+                    Record found = index.findRecordById(expectPresent);
+                    if (!sameRecord(found, makeRecord(expectPresent))) {
+                        cerr << "Reader " << readerIdx << ": id " << expectPresent << " was inserted but "
+                             << (found.id == -1 ? "is missing" : "came back different") << "\n";
+                        failed = true;
+                    }
+                }
+
+                // Ids below FIRST_ID are never inserted
+                int expectMissing = (int)(rng() % FIRST_ID);
+                if (index.findRecordById(expectMissing).id != -1) {
+                    cerr << "Reader " << readerIdx << ": found id " << expectMissing << " that was never inserted\n";
+                    failed = true;
+                }
+
+                // The newest record may or may not be in yet, whichever it is the record has to be whole
+                Record racing = index.findRecordById(FIRST_ID + visible);
+                if (racing.id != -1 && !sameRecord(racing, makeRecord(FIRST_ID + visible))) {
+                    cerr << "Reader " << readerIdx << ": id " << FIRST_ID + visible << " came back torn\n";
+                    failed = true;
+                }
+
+                lookups += 3;
+                if (lastRound)
+                    break;
+
+            }
+
+            numLookups += lookups;
+
+        };
+
+        vector<thread> readers;
+        for (int readerIdx = 0; readerIdx < numReaders; readerIdx++)
+            readers.emplace_back(reader, readerIdx);
+
+        for (int k = 0; k < numRecords && !failed; k++) {
+            index.insertRecord(makeRecord(FIRST_ID + k));
+            published = k + 1;
+        }
+        writerDone = true;
+
+        for (thread &t : readers)
+            t.join();
+
+        // Everything has to be there once the writer is done
+        for (int k = 0; k < numRecords && !failed; k++) {
+            if (!sameRecord(index.findRecordById(FIRST_ID + k), makeRecord(FIRST_ID + k))) {
+                cerr << "Id " << FIRST_ID + k << " is missing after all inserts\n";
+                failed = true;
+            }
+        }
+
+        cout << numRecords << " inserts, " << numLookups << " concurrent lookups by " << numReaders << " readers, "
+             << index.stats().numBuckets << " buckets\n";
+    }
+
+    remove(indexFName.c_str());
+
+    if (failed) {
+        cout << "FAILED\n";
+        return 1;
+    }
+
+    cout << "OK\n";
+    return 0;
+
+}